@@ -19,6 +19,10 @@ public:
     esp_err_t prepare_for_deep_sleep();
     esp_err_t configure();
 
+    // arm/disarm waking from light sleep on scanner input
+    esp_err_t enable_wakeup();
+    void disable_wakeup();
+
     int read_bytes(uint8_t* dst, size_t len, TickType_t timeout_ticks) const;
     void flush_input() const;
 
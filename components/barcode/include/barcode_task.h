@@ -3,11 +3,12 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/queue.h>
+#include "print_channel.h"
 
 class BarcodeDevice;
 
 struct BarcodeTaskParams {
-    QueueHandle_t printQueue;
+    PrintChannel& print;
     EventGroupHandle_t eventGroup;
     BarcodeDevice& device;
 };
@@ -2,6 +2,7 @@
 
 #include "sdkconfig.h"
 #include "driver/gpio.h"
+#include "esp_sleep.h"
 #include "esp_log.h"
 
 static const char* TAG = "BARCODE_DEVICE";
@@ -26,7 +27,12 @@ esp_err_t BarcodeDevice::init()
         .stop_bits = UART_STOP_BITS_1,
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
         .rx_flow_ctrl_thresh = 0,
+#if CONFIG_PM_ENABLE
+        // REF_TICK keeps the baud rate stable while DFS scales the APB clock
+        .source_clk = UART_SCLK_REF_TICK,
+#else
         .source_clk = UART_SCLK_DEFAULT,
+#endif
         .flags = {
             .allow_pd = 0,
             .backup_before_sleep = 0
@@ -146,6 +152,32 @@ esp_err_t BarcodeDevice::configure()
     return ESP_OK;
 }
 
+esp_err_t BarcodeDevice::enable_wakeup()
+{
+#if CONFIG_BARCODE_WAKEUP_UART
+    esp_err_t err = uart_set_wakeup_threshold(port_, CONFIG_BARCODE_WAKEUP_THRESHOLD);
+    if (err != ESP_OK) return err;
+    return esp_sleep_enable_uart_wakeup(port_);
+#elif CONFIG_BARCODE_WAKEUP_GPIO
+    const gpio_num_t rx_pin = static_cast<gpio_num_t>(CONFIG_BARCODE_RX_PIN);
+    esp_err_t err = gpio_wakeup_enable(rx_pin, GPIO_INTR_LOW_LEVEL);
+    if (err != ESP_OK) return err;
+    return esp_sleep_enable_gpio_wakeup();
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+void BarcodeDevice::disable_wakeup()
+{
+#if CONFIG_BARCODE_WAKEUP_UART
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_UART);
+#elif CONFIG_BARCODE_WAKEUP_GPIO
+    gpio_wakeup_disable(static_cast<gpio_num_t>(CONFIG_BARCODE_RX_PIN));
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+#endif
+}
+
 int BarcodeDevice::read_bytes(uint8_t* dst, const size_t len, const TickType_t timeout_ticks) const
 {
     if (!initialized_) {
@@ -5,6 +5,12 @@
 #include "barcode_device.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "power_manager.h"
+#include "boot_timeline.h"
+#include "heap_audit.h"
+#include "scan_latency.h"
 
 static const char *TAG = "BARCODE";
 
@@ -16,13 +22,31 @@ static bool is_numeric(const char *s) {
     return true;
 }
 
+// EAN-8, UPC-A, EAN-13 and ITF-14 share the GS1 mod 10 check digit
+static bool is_intact_gtin(const char* code, const size_t len)
+{
+    if (len != 8 && len != 12 && len != 13 && len != 14) {
+        return false;
+    }
+
+    int sum = 0;
+    for (size_t i = 0; i < len - 1; ++i) {
+        const int digit = code[len - 2 - i] - '0';
+        sum += (i % 2 == 0) ? digit * 3 : digit;
+    }
+    return (10 - sum % 10) % 10 == code[len - 1] - '0';
+}
+
 static void process_rx_chunk(const BarcodeTaskParams* params,
                              const uint8_t* rx,
                              const int n,
                              char* buffer,
                              size_t& buffer_occupancy,
-                             bool& overflow)
+                             bool& overflow,
+                             bool& resync)
 {
+    PowerLockGuard pm_lock(POWER_LOCK_SCANNER);
+
     for (int i = 0; i < n; ++i) {
         const char c = static_cast<char>(rx[i]);
 
@@ -38,14 +62,32 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
         }
 
         if (buffer_occupancy == 0) {
+            resync = false;
             continue;
         }
 
+        // the first bytes after a light-sleep wake may be lost, only a frame that still
+        // carries a valid GS1 check digit is looked up, a truncated one is rejected
+        if (resync) {
+            resync = false;
+            if (!overflow && !is_intact_gtin(buffer, buffer_occupancy)) {
+                ESP_LOGW(TAG, "Dropping damaged frame received during wakeup: %.*s", (int)buffer_occupancy, buffer);
+
+                PrintMessage msg{};
+                msg.type = ERROR_MSG;
+                msg.data.error = PRINT_ERR_RETRY_SCAN;
+                params->print.post_screen(msg);
+
+                buffer_occupancy = 0;
+                continue;
+            }
+        }
+
         if (overflow) {
             PrintMessage msg{};
             msg.type = ERROR_MSG;
-            strlcpy(msg.data.error.msg, "Barcode too long", sizeof(msg.data.error.msg));
-            xQueueSend(params->printQueue, &msg, 0);
+            msg.data.error = PRINT_ERR_BARCODE_TOO_LONG;
+            params->print.post_screen(msg);
 
             buffer_occupancy = 0;
             overflow = false;
@@ -58,19 +100,49 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
         if (is_numeric(buffer)) {
             ScanEvent evt{};
             strlcpy(evt.barcode, buffer, sizeof(evt.barcode));
-            if (esp_event_post(APP_EVENT, APP_EVENT_BARCODE_SCANNED, &evt, sizeof(evt), pdMS_TO_TICKS(3000)) != ESP_OK) {
+            heap_audit_scan_begin();
+            scan_latency_begin();
+            scan_ring_push(evt);
+            if (esp_event_post(APP_EVENT, APP_EVENT_BARCODE_SCANNED, nullptr, 0, pdMS_TO_TICKS(3000)) != ESP_OK) {
                 ESP_LOGW(TAG, "Event post timed out, barcode dropped");
             }
         } else {
             PrintMessage msg{};
             msg.type = ERROR_MSG;
-            strlcpy(msg.data.error.msg, "Zkuste prosim znovu...", sizeof(msg.data.error.msg));
-            xQueueSend(params->printQueue, &msg, 0);
+            msg.data.error = PRINT_ERR_RETRY_SCAN;
+            params->print.post_screen(msg);
         }
         buffer_occupancy = 0;
     }
 }
 
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+static bool station_enter_idle(BarcodeDevice& device)
+{
+    const esp_err_t err = device.enable_wakeup();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot arm scanner wakeup (%s), staying awake", esp_err_to_name(err));
+        return false;
+    }
+
+    ESP_LOGD(TAG, "Scanner idle, allowing light sleep");
+    esp_event_post(APP_EVENT, APP_EVENT_STATION_IDLE, nullptr, 0, 0);
+    power_lock_release(POWER_LOCK_ACTIVE);
+    return true;
+}
+
+static bool station_leave_idle(BarcodeDevice& device)
+{
+    power_lock_acquire(POWER_LOCK_ACTIVE);
+    device.disable_wakeup();
+    esp_event_post(APP_EVENT, APP_EVENT_STATION_ACTIVE, nullptr, 0, 0);
+
+    const esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+    ESP_LOGD(TAG, "Scanner active again (wakeup cause %d)", static_cast<int>(cause));
+    return cause == ESP_SLEEP_WAKEUP_UART || cause == ESP_SLEEP_WAKEUP_GPIO;
+}
+#endif
+
 [[noreturn]] void barcode_task(void *pvParameters) {
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
 
@@ -78,14 +150,20 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
 
     const auto* params = static_cast<const BarcodeTaskParams*>(pvParameters);
     BarcodeDevice& device = params->device;
+    heap_audit_watch_current_task();
 
     ESP_ERROR_CHECK(device.init());
     ESP_ERROR_CHECK(device.wake());
+    boot_timeline_mark(BOOT_STAGE_SCANNER_READY);
 
     uint8_t rx[64];
     char buffer[CONFIG_MAX_BARCODE_BUFFER_SIZE + 1];
     size_t buffer_occupancy = 0;
     bool overflow = false;
+    bool resync = false;
+
+    bool idle = false;
+    int64_t last_rx_us = esp_timer_get_time();
 
     for (;;) {
         const EventBits_t req_bits = xEventGroupWaitBits(
@@ -99,12 +177,22 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
         if ((req_bits & BIT_REQ_STOP) != 0) {
             const int n_pending = device.read_bytes(rx, sizeof(rx), 0);
             if (n_pending > 0) {
-                process_rx_chunk(params, rx, n_pending, buffer, buffer_occupancy, overflow);
+                process_rx_chunk(params, rx, n_pending, buffer, buffer_occupancy, overflow, resync);
             }
 
-            ESP_LOGI(TAG, "Barcode task ready, acknowledging STOP and suspending");
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+            if (idle) {
+                (void)station_leave_idle(device);
+                idle = false;
+            }
+#endif
+
+            ESP_LOGI(TAG, "Barcode task ready, acknowledging STOP");
             xEventGroupSetBits(params->eventGroup, BIT_ACK_BARCODE);
-            vTaskSuspend(nullptr);
+
+            // a level, not an edge, so a WAKE that came before this point is not missed
+            xEventGroupWaitBits(params->eventGroup, BIT_REQ_RESUME, pdFALSE, pdFALSE, portMAX_DELAY);
+            last_rx_us = esp_timer_get_time();
         }
 
         if ((req_bits & BIT_REQ_BARCODE_SCANNER_CONF) != 0) {
@@ -124,7 +212,8 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
             xEventGroupSetBits(params->eventGroup, BIT_ACK_BARCODE);
         }
 
-        const int n = device.read_bytes(rx, sizeof(rx), pdMS_TO_TICKS(50));
+        // poll slower while idle so light sleep periods are not cut short
+        const int n = device.read_bytes(rx, sizeof(rx), pdMS_TO_TICKS(idle ? 1000 : 50));
 
         if (n < 0) {
             ESP_LOGE(TAG, "UART Read Error");
@@ -133,9 +222,27 @@ static void process_rx_chunk(const BarcodeTaskParams* params,
         }
 
         if (n == 0) {
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+            if (!idle && esp_timer_get_time() - last_rx_us >= CONFIG_BARCODE_IDLE_LIGHT_SLEEP_S * 1000000LL) {
+                idle = station_enter_idle(device);
+                if (!idle) {
+                    last_rx_us = esp_timer_get_time();
+                }
+            }
+#endif
             continue;
         }
 
-        process_rx_chunk(params, rx, n, buffer, buffer_occupancy, overflow);
+        last_rx_us = esp_timer_get_time();
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+        if (idle) {
+            if (station_leave_idle(device) && buffer_occupancy == 0) {
+                resync = true;
+            }
+            idle = false;
+        }
+#endif
+
+        process_rx_chunk(params, rx, n, buffer, buffer_occupancy, overflow, resync);
     }
 }
\ No newline at end of file
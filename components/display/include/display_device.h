@@ -1,7 +1,28 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include "esp_err.h"
 
+struct DisplayStats {
+    uint32_t invalidated_areas;
+    uint32_t flushes;
+    uint64_t flushed_bytes;
+    uint32_t frames;
+    uint32_t last_frame_us;
+    uint32_t max_frame_us;
+    uint64_t total_frame_us;
+    uint32_t first_frame_us;    // time since boot until the first frame was rendered
+    bool resumed;               // panel resumed from sleep-in instead of a full reset
+};
+
+struct DisplayMemStats {
+    uint32_t total_bytes;       // LVGL object pool
+    uint32_t free_bytes;
+    uint32_t max_used_bytes;
+    uint8_t frag_pct;
+};
+
 class DisplayDevice {
 public:
     DisplayDevice();
@@ -10,10 +31,24 @@ public:
     esp_err_t sleep();
     void deinit();
 
+    // backlight changes run on the LEDC fade engine and do not block the caller
+    void fade_out();
+    void backlight_dim();
+    void backlight_restore();
+
+    esp_err_t run_frame_benchmark(uint32_t frames);
+
     bool is_initialized() const { return initialized_; }
+    DisplayStats stats() const { return stats_; }
+
+    // takes the LVGL lock, false if it is busy or the display is not up
+    bool memory_stats(DisplayMemStats& out, uint32_t timeout_ms) const;
 
 private:
     bool initialized_;
+    DisplayStats stats_;
+    std::atomic<bool> backlight_dimmed_;
+    bool fading_out_;
     void* io_handle_;
     void* panel_handle_;
     void* disp_;
@@ -1,15 +1,20 @@
 #pragma once
 
+#include <cstdint>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/queue.h>
+#include "print_channel.h"
 
 class DisplayDevice;
 
 struct DisplayTaskParams {
-    QueueHandle_t printQueue;
+    PrintChannel& print;
     EventGroupHandle_t eventGroup;
     DisplayDevice& device;
 };
 
 [[noreturn]] void display_task(void *pvParameters);
+
+// number of queued messages folded away instead of rendered, since boot
+uint32_t display_task_skipped_frames();
@@ -2,6 +2,10 @@
 
 #include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
 #include "esp_lvgl_port.h"
 #include "esp_lcd_panel_io.h"
 #include "esp_lcd_panel_ops.h"
@@ -10,7 +14,10 @@
 #include "driver/spi_master.h"
 #include "driver/gpio.h"
 #include "driver/ledc.h"
+#include "freertos/semphr.h"
 #include "lvgl.h"
+#include "power_manager.h"
+#include "task_plan.h"
 
 static const char* TAG = "DISPLAY_DEVICE";
 
@@ -18,8 +25,55 @@ static const char* TAG = "DISPLAY_DEVICE";
 #define LEDC_TIMER              LEDC_TIMER_0
 #define LEDC_DUTY_RES           LEDC_TIMER_8_BIT
 #define LEDC_FREQUENCY          5000
+#define LEDC_CHANNEL            LEDC_CHANNEL_0
 #define LEDC_DUTY_ON            200
-#define LEDC_FADE_DELAY_MS      10
+
+#define DISPLAY_HRES            320
+#define DISPLAY_VRES            240
+#define DISPLAY_BUFFER_PIXELS   (DISPLAY_HRES * CONFIG_DISPLAY_BUFFER_LINES)
+
+static_assert(CONFIG_DISPLAY_PCLK_MHZ <= 40, "ILI9341 over GPIO-matrix SPI is not stable above 40 MHz");
+
+#if CONFIG_DISPLAY_DOUBLE_BUFFER
+#define DISPLAY_DRAW_BUFFERS    2
+#else
+#define DISPLAY_DRAW_BUFFERS    1
+#endif
+
+// .bss DMA buffers, past this the image does not link or leaves Wi-Fi and TLS without DRAM
+static_assert(DISPLAY_DRAW_BUFFERS * DISPLAY_BUFFER_PIXELS * sizeof(uint16_t) <= 100 * 1024,
+              "LVGL draw buffers exceed 100 KB of DMA-capable DRAM");
+
+#define LCD_CMD_SLEEP_IN        0x10
+#define LCD_CMD_SLEEP_OUT       0x11
+#define LCD_CMD_DISPLAY_OFF     0x28
+#define LCD_SLEEP_OUT_DELAY_MS  5
+
+static constexpr uint32_t PANEL_SLEEP_MAGIC = 0x534C5049; // "SLPI"
+
+// panel was put into sleep-in with RST held high before deep sleep, GRAM and registers are retained
+RTC_DATA_ATTR static uint32_t s_panel_sleep_magic = 0;
+
+// draw buffers live in .bss so the render path never depends on heap state, see main.cpp for the budget
+DMA_ATTR static uint16_t s_draw_buf1[DISPLAY_BUFFER_PIXELS];
+#if CONFIG_DISPLAY_DOUBLE_BUFFER
+DMA_ATTR static uint16_t s_draw_buf2[DISPLAY_BUFFER_PIXELS];
+#endif
+
+static int64_t s_frame_started_us = 0;
+static bool s_flush_lock_held = false;
+
+static SemaphoreHandle_t s_fade_done = nullptr;
+static StaticSemaphore_t s_fade_done_storage;
+
+static bool IRAM_ATTR on_backlight_fade_end(const ledc_cb_param_t* param, void*)
+{
+    BaseType_t woken = pdFALSE;
+    if (param->event == LEDC_FADE_END_EVT) {
+        xSemaphoreGiveFromISR(s_fade_done, &woken);
+    }
+    return woken == pdTRUE;
+}
 
 static void init_backlight_pwm()
 {
@@ -30,62 +84,104 @@ static void init_backlight_pwm()
     ledc_timer_cfg.duty_resolution  = LEDC_DUTY_RES;
     ledc_timer_cfg.timer_num        = LEDC_TIMER;
     ledc_timer_cfg.freq_hz          = LEDC_FREQUENCY;
+#if CONFIG_PM_ENABLE
+    // APB scales with DFS, RC_FAST keeps the PWM frequency constant
+    ledc_timer_cfg.clk_cfg          = LEDC_USE_RC_FAST_CLK;
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+    // keep the backlight PWM running while the station light-sleeps between scans
+    esp_sleep_pd_config(ESP_PD_DOMAIN_RC_FAST, ESP_PD_OPTION_ON);
+#endif
+#else
     ledc_timer_cfg.clk_cfg          = LEDC_AUTO_CLK;
+#endif
     ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer_cfg));
 
     ledc_channel_config_t chan_cfg{};
     chan_cfg.gpio_num       = CONFIG_LED_PIN;
     chan_cfg.speed_mode     = LEDC_MODE;
-    chan_cfg.channel        = LEDC_CHANNEL_0;
+    chan_cfg.channel        = LEDC_CHANNEL;
     chan_cfg.intr_type      = LEDC_INTR_DISABLE;
     chan_cfg.timer_sel      = LEDC_TIMER;
     chan_cfg.duty           = 0;
     chan_cfg.hpoint         = 0;
     ESP_ERROR_CHECK(ledc_channel_config(&chan_cfg));
-}
-
-static void set_backlight_brightness(const uint32_t duty)
-{
-    ledc_set_duty(LEDC_MODE, LEDC_CHANNEL_0, duty);
-    ledc_update_duty(LEDC_MODE, LEDC_CHANNEL_0);
-}
-
-static void display_backlight_fade_on(const uint32_t max_brightness, const uint32_t fade_step = 20)
-{
-    uint32_t duty = 0;
-    while (true) {
-        set_backlight_brightness(duty);
-        vTaskDelay(pdMS_TO_TICKS(LEDC_FADE_DELAY_MS));
 
-        if (duty == max_brightness) {
-            break;
-        }
+    if (s_fade_done == nullptr) {
+        s_fade_done = xSemaphoreCreateBinaryStatic(&s_fade_done_storage);
+    }
 
-        duty = (duty + fade_step >= max_brightness) ? max_brightness : (duty + fade_step);
+    const esp_err_t fade_err = ledc_fade_func_install(0);
+    if (fade_err != ESP_OK && fade_err != ESP_ERR_INVALID_STATE) {
+        ESP_ERROR_CHECK(fade_err);
     }
 
-    set_backlight_brightness(max_brightness);
+    ledc_cbs_t cbs{};
+    cbs.fade_cb = on_backlight_fade_end;
+    ESP_ERROR_CHECK(ledc_cb_register(LEDC_MODE, LEDC_CHANNEL, &cbs, nullptr));
 }
 
-static void display_backlight_fade_off(const uint32_t fade_step = 20)
+// runs in the LEDC fade engine, returns immediately
+static void backlight_fade_start(const uint32_t duty)
 {
-    uint32_t duty = LEDC_DUTY_ON;
-    while (true) {
-        set_backlight_brightness(duty);
-        vTaskDelay(pdMS_TO_TICKS(LEDC_FADE_DELAY_MS));
+    ledc_fade_stop(LEDC_MODE, LEDC_CHANNEL);
+    xSemaphoreTake(s_fade_done, 0);
+    ledc_set_fade_time_and_start(LEDC_MODE, LEDC_CHANNEL, duty, CONFIG_DISPLAY_BACKLIGHT_FADE_MS, LEDC_FADE_NO_WAIT);
+}
 
-        if (duty == 0) {
-            break;
-        }
+static void display_stats_event_cb(lv_event_t* e)
+{
+    auto* stats = static_cast<DisplayStats*>(lv_event_get_user_data(e));
+    const auto* area = static_cast<const lv_area_t*>(lv_event_get_param(e));
 
-        duty = (duty <= fade_step) ? 0 : (duty - fade_step);
+    switch (lv_event_get_code(e)) {
+        case LV_EVENT_INVALIDATE_AREA:
+            stats->invalidated_areas++;
+            break;
+        case LV_EVENT_RENDER_START:
+            power_lock_acquire(POWER_LOCK_RENDER);
+            s_frame_started_us = esp_timer_get_time();
+            break;
+        case LV_EVENT_RENDER_READY:
+            power_lock_release(POWER_LOCK_RENDER);
+            break;
+        case LV_EVENT_REFR_READY:
+            // the SPI driver holds its own APB lock per transaction, this one spans the whole frame flush
+            if (s_flush_lock_held) {
+                power_lock_release(POWER_LOCK_FLUSH);
+                s_flush_lock_held = false;
+            }
+            if (s_frame_started_us != 0) {
+                const auto frame_us = static_cast<uint32_t>(esp_timer_get_time() - s_frame_started_us);
+                s_frame_started_us = 0;
+                if (stats->frames == 0) {
+                    stats->first_frame_us = static_cast<uint32_t>(esp_timer_get_time());
+                }
+                stats->frames++;
+                stats->last_frame_us = frame_us;
+                stats->total_frame_us += frame_us;
+                if (frame_us > stats->max_frame_us) {
+                    stats->max_frame_us = frame_us;
+                }
+            }
+            break;
+        case LV_EVENT_FLUSH_START:
+            if (!s_flush_lock_held) {
+                power_lock_acquire(POWER_LOCK_FLUSH);
+                s_flush_lock_held = true;
+            }
+            stats->flushes++;
+            if (area != nullptr) {
+                stats->flushed_bytes += lv_area_get_size(area) * sizeof(uint16_t);
+            }
+            break;
+        default:
+            break;
     }
-
-    set_backlight_brightness(0);
 }
 
 DisplayDevice::DisplayDevice()
-    : initialized_(false), io_handle_(nullptr), panel_handle_(nullptr), disp_(nullptr) {}
+    : initialized_(false), stats_{}, backlight_dimmed_(false), fading_out_(false),
+      io_handle_(nullptr), panel_handle_(nullptr), disp_(nullptr) {}
 
 esp_err_t DisplayDevice::init()
 {
@@ -99,7 +195,7 @@ esp_err_t DisplayDevice::init()
     bus_cfg.miso_io_num = CONFIG_TFT_MISO;
     bus_cfg.quadwp_io_num = -1;
     bus_cfg.quadhd_io_num = -1;
-    bus_cfg.max_transfer_sz = 320 * 240 * sizeof(uint16_t) + 100;
+    bus_cfg.max_transfer_sz = DISPLAY_BUFFER_PIXELS * sizeof(uint16_t) + 100;
     esp_err_t err = spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
     if (err != ESP_OK) return err;
 
@@ -107,7 +203,7 @@ esp_err_t DisplayDevice::init()
     esp_lcd_panel_io_spi_config_t io_cfg{};
     io_cfg.cs_gpio_num = CONFIG_TFT_CS;
     io_cfg.dc_gpio_num = CONFIG_TFT_DC;
-    io_cfg.pclk_hz = 20 * 1000 * 1000;
+    io_cfg.pclk_hz = CONFIG_DISPLAY_PCLK_MHZ * 1000 * 1000;
     io_cfg.trans_queue_depth = 10;
     io_cfg.lcd_cmd_bits = 8;
     io_cfg.lcd_param_bits = 8;
@@ -118,9 +214,21 @@ esp_err_t DisplayDevice::init()
         return err;
     }
 
+    const bool resume = s_panel_sleep_magic == PANEL_SLEEP_MAGIC && esp_reset_reason() == ESP_RST_DEEPSLEEP;
+    s_panel_sleep_magic = 0;
+
+    const gpio_num_t rst_pin = static_cast<gpio_num_t>(CONFIG_TFT_RST);
+    if (resume) {
+        // latch RST high in the pad registers before releasing the hold, so the panel is not reset
+        gpio_reset_pin(rst_pin);
+        gpio_set_direction(rst_pin, GPIO_MODE_OUTPUT);
+        gpio_set_level(rst_pin, 1);
+    }
+    gpio_hold_dis(rst_pin);
+
     esp_lcd_panel_handle_t panel = nullptr;
     esp_lcd_panel_dev_config_t panel_cfg{};
-    panel_cfg.reset_gpio_num = CONFIG_TFT_RST;
+    panel_cfg.reset_gpio_num = resume ? -1 : CONFIG_TFT_RST;
     panel_cfg.rgb_ele_order = LCD_RGB_ELEMENT_ORDER_BGR;
     panel_cfg.bits_per_pixel = 16;
 
@@ -131,10 +239,15 @@ esp_err_t DisplayDevice::init()
         return err;
     }
 
-    ESP_ERROR_CHECK(esp_lcd_panel_reset(panel));
-    ESP_ERROR_CHECK(esp_lcd_panel_init(panel));
+    if (resume) {
+        ESP_ERROR_CHECK(esp_lcd_panel_io_tx_param(io_handle, LCD_CMD_SLEEP_OUT, nullptr, 0));
+        vTaskDelay(pdMS_TO_TICKS(LCD_SLEEP_OUT_DELAY_MS));
+    } else {
+        ESP_ERROR_CHECK(esp_lcd_panel_reset(panel));
+        ESP_ERROR_CHECK(esp_lcd_panel_init(panel));
 
-    vTaskDelay(pdMS_TO_TICKS(120));
+        vTaskDelay(pdMS_TO_TICKS(120));
+    }
 
     ESP_ERROR_CHECK(esp_lcd_panel_disp_on_off(panel, true));
     ESP_ERROR_CHECK(esp_lcd_panel_swap_xy(panel, false));
@@ -142,18 +255,24 @@ esp_err_t DisplayDevice::init()
     ESP_ERROR_CHECK(esp_lcd_panel_set_gap(panel, 0, 0));
 
     init_backlight_pwm();
-    display_backlight_fade_on(LEDC_DUTY_ON);
-
-    const lvgl_port_cfg_t lvgl_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    backlight_fade_start(LEDC_DUTY_ON);
+    backlight_dimmed_ = false;
+    fading_out_ = false;
+
+    lvgl_port_cfg_t lvgl_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    lvgl_cfg.task_priority = LVGL_TASK_PRIORITY;
+    // the port takes -1 for no affinity
+    lvgl_cfg.task_affinity = (UI_CORE == tskNO_AFFINITY) ? -1 : UI_CORE;
     ESP_ERROR_CHECK(lvgl_port_init(&lvgl_cfg));
 
     lvgl_port_display_cfg_t disp_cfg{};
     disp_cfg.io_handle = io_handle;
     disp_cfg.panel_handle = panel;
-    disp_cfg.buffer_size = 320 * 40;
+    // the port always allocates its own buffers, keep those to one line and swap in the static ones below
+    disp_cfg.buffer_size = DISPLAY_HRES;
     disp_cfg.double_buffer = false;
-    disp_cfg.hres = 320;
-    disp_cfg.vres = 240;
+    disp_cfg.hres = DISPLAY_HRES;
+    disp_cfg.vres = DISPLAY_VRES;
     disp_cfg.monochrome = false;
     disp_cfg.color_format = LV_COLOR_FORMAT_RGB565;
     disp_cfg.flags.swap_bytes = true;
@@ -172,6 +291,25 @@ esp_err_t DisplayDevice::init()
         return ESP_FAIL;
     }
 
+    if (lvgl_port_lock(0)) {
+#if CONFIG_DISPLAY_DOUBLE_BUFFER
+        // flush completes from the SPI DMA done callback, LVGL renders into the other buffer meanwhile
+        lv_display_set_buffers(disp, s_draw_buf1, s_draw_buf2, sizeof(s_draw_buf1), LV_DISPLAY_RENDER_MODE_PARTIAL);
+#else
+        lv_display_set_buffers(disp, s_draw_buf1, nullptr, sizeof(s_draw_buf1), LV_DISPLAY_RENDER_MODE_PARTIAL);
+#endif
+        lv_display_add_event_cb(disp, display_stats_event_cb, LV_EVENT_INVALIDATE_AREA, &stats_);
+        lv_display_add_event_cb(disp, display_stats_event_cb, LV_EVENT_FLUSH_START, &stats_);
+        lv_display_add_event_cb(disp, display_stats_event_cb, LV_EVENT_RENDER_START, &stats_);
+        lv_display_add_event_cb(disp, display_stats_event_cb, LV_EVENT_RENDER_READY, &stats_);
+        lv_display_add_event_cb(disp, display_stats_event_cb, LV_EVENT_REFR_READY, &stats_);
+        lvgl_port_unlock();
+    }
+
+    ESP_LOGI(TAG, "Panel %s after %lld ms since boot", resume ? "resumed from sleep-in" : "initialized",
+             esp_timer_get_time() / 1000);
+
+    stats_.resumed = resume;
     io_handle_ = io_handle;
     panel_handle_ = panel;
     disp_ = disp;
@@ -179,6 +317,23 @@ esp_err_t DisplayDevice::init()
     return ESP_OK;
 }
 
+bool DisplayDevice::memory_stats(DisplayMemStats& out, const uint32_t timeout_ms) const
+{
+    if (!initialized_ || !lvgl_port_lock(timeout_ms)) {
+        return false;
+    }
+
+    lv_mem_monitor_t mon{};
+    lv_mem_monitor(&mon);
+    lvgl_port_unlock();
+
+    out.total_bytes = mon.total_size;
+    out.free_bytes = mon.free_size;
+    out.max_used_bytes = mon.max_used;
+    out.frag_pct = mon.frag_pct;
+    return true;
+}
+
 esp_err_t DisplayDevice::sleep()
 {
     if (!initialized_) {
@@ -191,19 +346,97 @@ esp_err_t DisplayDevice::sleep()
 
     esp_lcd_panel_io_handle_t io = static_cast<esp_lcd_panel_io_handle_t>(io_handle_);
 
-    display_backlight_fade_off();
+    fade_out();
+    if (xSemaphoreTake(s_fade_done, pdMS_TO_TICKS(CONFIG_DISPLAY_BACKLIGHT_FADE_MS + 50)) != pdTRUE) {
+        ESP_LOGW(TAG, "sleep: backlight fade did not finish, cutting it");
+    }
+    ledc_fade_stop(LEDC_MODE, LEDC_CHANNEL);
 
-    ledc_stop(LEDC_MODE, LEDC_CHANNEL_0, 0);
+    ledc_stop(LEDC_MODE, LEDC_CHANNEL, 0);
     gpio_set_direction((gpio_num_t)CONFIG_LED_PIN, GPIO_MODE_OUTPUT);
     gpio_set_level((gpio_num_t)CONFIG_LED_PIN, 0);
     gpio_hold_en((gpio_num_t)CONFIG_LED_PIN);
 
-    esp_lcd_panel_io_tx_param(io, 0x28, nullptr, 0);
+    esp_lcd_panel_io_tx_param(io, LCD_CMD_DISPLAY_OFF, nullptr, 0);
     vTaskDelay(pdMS_TO_TICKS(20));
 
-    esp_lcd_panel_io_tx_param(io, 0x10, nullptr, 0);
+    esp_lcd_panel_io_tx_param(io, LCD_CMD_SLEEP_IN, nullptr, 0);
     vTaskDelay(pdMS_TO_TICKS(120));
 
+    // keep the panel out of reset through deep sleep so the next wake can resume it
+    const gpio_num_t rst_pin = static_cast<gpio_num_t>(CONFIG_TFT_RST);
+    gpio_set_level(rst_pin, 1);
+    gpio_hold_en(rst_pin);
+    s_panel_sleep_magic = PANEL_SLEEP_MAGIC;
+
+    return ESP_OK;
+}
+
+void DisplayDevice::fade_out()
+{
+    if (!initialized_ || fading_out_) {
+        return;
+    }
+    fading_out_ = true;
+    backlight_fade_start(0);
+}
+
+void DisplayDevice::backlight_dim()
+{
+    if (!initialized_ || fading_out_ || backlight_dimmed_.exchange(true)) {
+        return;
+    }
+    backlight_fade_start(CONFIG_DISPLAY_IDLE_DIM_DUTY);
+}
+
+void DisplayDevice::backlight_restore()
+{
+    if (!initialized_ || fading_out_ || !backlight_dimmed_.exchange(false)) {
+        return;
+    }
+    ledc_fade_stop(LEDC_MODE, LEDC_CHANNEL);
+    ledc_set_duty_and_update(LEDC_MODE, LEDC_CHANNEL, LEDC_DUTY_ON, 0);
+}
+
+esp_err_t DisplayDevice::run_frame_benchmark(const uint32_t frames)
+{
+    if (!initialized_ || frames == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    lv_display_t* disp = static_cast<lv_display_t*>(disp_);
+    const DisplayStats before = stats_;
+    const int64_t started_us = esp_timer_get_time();
+
+    for (uint32_t i = 0; i < frames; ++i) {
+        if (!lvgl_port_lock(1000)) {
+            return ESP_ERR_TIMEOUT;
+        }
+        lv_obj_invalidate(lv_screen_active());
+        lv_refr_now(disp);
+        lvgl_port_unlock();
+    }
+
+    const int64_t elapsed_us = esp_timer_get_time() - started_us;
+    const uint32_t rendered = stats_.frames - before.frames;
+    const uint64_t render_us = stats_.total_frame_us - before.total_frame_us;
+
+    ESP_LOGI(TAG, "Frame benchmark: %lu MHz, %d lines, %s buffer: %lu frames, avg %lld us/frame (%.1f fps), "
+                  "render avg %llu us, max %lu us, %llu bytes flushed",
+             (unsigned long)CONFIG_DISPLAY_PCLK_MHZ,
+             CONFIG_DISPLAY_BUFFER_LINES,
+#if CONFIG_DISPLAY_DOUBLE_BUFFER
+             "double",
+#else
+             "single",
+#endif
+             (unsigned long)frames,
+             elapsed_us / frames,
+             frames * 1000000.0 / static_cast<double>(elapsed_us),
+             (unsigned long long)(rendered > 0 ? render_us / rendered : 0),
+             (unsigned long)stats_.max_frame_us,
+             (unsigned long long)(stats_.flushed_bytes - before.flushed_bytes));
+
     return ESP_OK;
 }
 
@@ -1,44 +1,158 @@
 #include "display_task.h"
 #include <cstdio>
 #include <cstring>
+#include <atomic>
+#include "sdkconfig.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_event.h"
+#include "esp_timer.h"
 #include "esp_lvgl_port.h"
 #include "soc/soc_caps.h"
 #include "lvgl.h"
 #include "events.h"
-#include "print_message.h"
+#include "print_channel.h"
 #include "display_device.h"
+#include "boot_timeline.h"
+#include "heap_audit.h"
+#include "scan_latency.h"
 
 static const char *TAG = "DISPLAY";
 
+#if CONFIG_DISPLAY_SUBSET_FONTS
+// generated at build time by tools/gen_subset_fonts.py
+LV_FONT_DECLARE(station_font_10)
+LV_FONT_DECLARE(station_font_18)
+LV_FONT_DECLARE(station_font_22)
+LV_FONT_DECLARE(station_font_24)
+LV_FONT_DECLARE(station_font_28)
+LV_FONT_DECLARE(station_font_38)
+#define UI_FONT(size) (&station_font_##size)
+#else
+#define UI_FONT(size) (&lv_font_montserrat_##size)
+#endif
+
 #if !SOC_RTCIO_HOLD_SUPPORTED
     #error "CRITICAL ERROR: The selected ESP chip does not support RTC GPIO Hold!"
 #endif
 
+enum UiRole : uint8_t {
+    UI_ROLE_STATUS_OK,
+    UI_ROLE_STATUS_ERROR,
+    UI_ROLE_IDLE_TEXT,
+    UI_ROLE_IDLE_BLANK,
+    UI_ROLE_ERROR_TEXT,
+    UI_ROLE_ERROR_BLANK,
+    UI_ROLE_PRODUCT_NAME,
+    UI_ROLE_PRODUCT_PRICE,
+    UI_ROLE_PRODUCT_DETAIL,
+    UI_ROLE_COUNT,
+    UI_ROLE_NONE = UI_ROLE_COUNT,
+};
+
+struct UiRoleStyle {
+    uint32_t color_hex;
+    const lv_font_t *font;
+};
+
+static const UiRoleStyle UI_ROLE_STYLES[UI_ROLE_COUNT] = {
+    {0x00FF00, UI_FONT(10)}, // UI_ROLE_STATUS_OK
+    {0xFF0000, UI_FONT(10)}, // UI_ROLE_STATUS_ERROR
+    {0xFFFFFF, UI_FONT(22)}, // UI_ROLE_IDLE_TEXT
+    {0x000000, UI_FONT(22)}, // UI_ROLE_IDLE_BLANK
+    {0xFF0000, UI_FONT(28)}, // UI_ROLE_ERROR_TEXT
+    {0x000000, UI_FONT(28)}, // UI_ROLE_ERROR_BLANK
+    {0xFFFFFF, UI_FONT(24)}, // UI_ROLE_PRODUCT_NAME
+    {0x00FF00, UI_FONT(38)}, // UI_ROLE_PRODUCT_PRICE
+    {0xFFFFFF, UI_FONT(18)}, // UI_ROLE_PRODUCT_DETAIL
+};
+
+static lv_style_t s_role_styles[UI_ROLE_COUNT];
+static bool s_role_styles_ready = false;
+
+struct UiLabel {
+    lv_obj_t *obj;
+    UiRole role;
+};
+
 struct UiContext {
     lv_obj_t *root;
     lv_obj_t *cont_main;
     lv_obj_t *cont_status;
-    lv_obj_t *lbl_wifi;
-    lv_obj_t *lbl_mqtt;
-    lv_obj_t *lbl_name;
-    lv_obj_t *lbl_price;
-    lv_obj_t *lbl_unit;
-    lv_obj_t *lbl_stock;
+    UiLabel lbl_wifi;
+    UiLabel lbl_mqtt;
+    UiLabel lbl_name;
+    UiLabel lbl_price;
+    UiLabel lbl_unit;
+    UiLabel lbl_stock;
     bool wifi_connected;
     bool mqtt_connected;
     int ip_suffix;
 };
 
-static void ui_set_text(lv_obj_t *label, const char *text, uint32_t color_hex, const lv_font_t *font)
+struct PendingFrame {
+    bool status_dirty;
+    bool has_screen;
+    PrintMessage screen;
+    uint32_t received;
+};
+
+// the screen itself, not a PrintMessage: pool slots do not survive deep sleep
+struct UiSnapshot {
+    uint32_t magic;
+    PrintMessageType type;
+    PrintError error;
+    ProductData product;
+};
+
+static constexpr uint32_t UI_SNAPSHOT_MAGIC = 0x55495337; // "UIS7"
+
+// last product/error screen, redrawn on the next wake from deep sleep
+RTC_DATA_ATTR static UiSnapshot s_snapshot;
+
+static std::atomic<uint32_t> s_skipped_frames{0};
+static std::atomic<int64_t> s_last_activity_us{0};
+static uint64_t s_last_screen_flushed_bytes = 0;
+
+static void ui_styles_init()
+{
+    if (s_role_styles_ready) {
+        return;
+    }
+
+    for (int role = 0; role < UI_ROLE_COUNT; ++role) {
+        lv_style_init(&s_role_styles[role]);
+        lv_style_set_text_color(&s_role_styles[role], lv_color_hex(UI_ROLE_STYLES[role].color_hex));
+        lv_style_set_text_font(&s_role_styles[role], UI_ROLE_STYLES[role].font);
+    }
+    s_role_styles_ready = true;
+}
+
+static UiLabel ui_label_create(lv_obj_t *parent)
+{
+    return UiLabel{ .obj = lv_label_create(parent), .role = UI_ROLE_NONE };
+}
+
+// swaps the shared role style only on role change and skips identical text,
+// so an unchanged label is neither restyled nor invalidated
+static void ui_set_text(UiLabel &label, const char *text, const UiRole role)
 {
     if (text == nullptr) text = "";
-    lv_label_set_text(label, text);
-    lv_obj_set_style_text_color(label, lv_color_hex(color_hex), LV_PART_MAIN);
-    lv_obj_set_style_text_font(label, font, LV_PART_MAIN);
+
+    if (label.role != role) {
+        if (label.role != UI_ROLE_NONE) {
+            lv_obj_remove_style(label.obj, &s_role_styles[label.role], LV_PART_MAIN);
+        }
+        lv_obj_add_style(label.obj, &s_role_styles[role], LV_PART_MAIN);
+        label.role = role;
+    }
+
+    if (strcmp(lv_label_get_text(label.obj), text) != 0) {
+        lv_label_set_text(label.obj, text);
+    }
 }
 
-static void ui_render_status(const UiContext &ui)
+static void ui_render_status(UiContext &ui)
 {
     char wifi_buf[32];
     if (ui.wifi_connected) {
@@ -47,20 +161,18 @@ static void ui_render_status(const UiContext &ui)
         } else {
             snprintf(wifi_buf, sizeof(wifi_buf), "WiFi");
         }
-        ui_set_text(ui.lbl_wifi, wifi_buf, 0x00FF00, &lv_font_montserrat_10);
+        ui_set_text(ui.lbl_wifi, wifi_buf, UI_ROLE_STATUS_OK);
     } else {
-        ui_set_text(ui.lbl_wifi, "WiFi", 0xFF0000, &lv_font_montserrat_10);
+        ui_set_text(ui.lbl_wifi, "WiFi", UI_ROLE_STATUS_ERROR);
     }
 
-    if (ui.mqtt_connected) {
-        ui_set_text(ui.lbl_mqtt, "MQTT", 0x00FF00, &lv_font_montserrat_10);
-    } else {
-        ui_set_text(ui.lbl_mqtt, "MQTT", 0xFF0000, &lv_font_montserrat_10);
-    }
+    ui_set_text(ui.lbl_mqtt, "MQTT", ui.mqtt_connected ? UI_ROLE_STATUS_OK : UI_ROLE_STATUS_ERROR);
 }
 
 static void ui_init(UiContext &ui)
 {
+    ui_styles_init();
+
     ui.root = lv_screen_active();
     lv_obj_clean(ui.root);
     lv_obj_set_style_bg_color(ui.root, lv_color_hex(0x000000), LV_PART_MAIN);
@@ -86,24 +198,24 @@ static void ui_init(UiContext &ui)
     lv_obj_set_scrollbar_mode(ui.cont_status, LV_SCROLLBAR_MODE_OFF);
     lv_obj_align(ui.cont_status, LV_ALIGN_BOTTOM_RIGHT, -4, -4);
 
-    ui.lbl_wifi = lv_label_create(ui.cont_status);
-    ui.lbl_mqtt = lv_label_create(ui.cont_status);
+    ui.lbl_wifi = ui_label_create(ui.cont_status);
+    ui.lbl_mqtt = ui_label_create(ui.cont_status);
 
-    ui.lbl_name = lv_label_create(ui.cont_main);
-    lv_label_set_long_mode(ui.lbl_name, LV_LABEL_LONG_MODE_WRAP);
-    lv_obj_set_width(ui.lbl_name, LV_PCT(100));
+    ui.lbl_name = ui_label_create(ui.cont_main);
+    lv_label_set_long_mode(ui.lbl_name.obj, LV_LABEL_LONG_MODE_WRAP);
+    lv_obj_set_width(ui.lbl_name.obj, LV_PCT(100));
 
-    ui.lbl_price = lv_label_create(ui.cont_main);
-    lv_label_set_long_mode(ui.lbl_price, LV_LABEL_LONG_MODE_WRAP);
-    lv_obj_set_width(ui.lbl_price, LV_PCT(100));
+    ui.lbl_price = ui_label_create(ui.cont_main);
+    lv_label_set_long_mode(ui.lbl_price.obj, LV_LABEL_LONG_MODE_WRAP);
+    lv_obj_set_width(ui.lbl_price.obj, LV_PCT(100));
 
-    ui.lbl_unit = lv_label_create(ui.cont_main);
-    lv_label_set_long_mode(ui.lbl_unit, LV_LABEL_LONG_MODE_WRAP);
-    lv_obj_set_width(ui.lbl_unit, LV_PCT(100));
+    ui.lbl_unit = ui_label_create(ui.cont_main);
+    lv_label_set_long_mode(ui.lbl_unit.obj, LV_LABEL_LONG_MODE_WRAP);
+    lv_obj_set_width(ui.lbl_unit.obj, LV_PCT(100));
 
-    ui.lbl_stock = lv_label_create(ui.cont_main);
-    lv_label_set_long_mode(ui.lbl_stock, LV_LABEL_LONG_MODE_WRAP);
-    lv_obj_set_width(ui.lbl_stock, LV_PCT(100));
+    ui.lbl_stock = ui_label_create(ui.cont_main);
+    lv_label_set_long_mode(ui.lbl_stock.obj, LV_LABEL_LONG_MODE_WRAP);
+    lv_obj_set_width(ui.lbl_stock.obj, LV_PCT(100));
 
     ui.wifi_connected = false;
     ui.mqtt_connected = false;
@@ -111,42 +223,53 @@ static void ui_init(UiContext &ui)
 
     ui_render_status(ui);
 
-    ui_set_text(ui.lbl_name, "^__^", 0xFFFFFF, &lv_font_montserrat_22);
-    ui_set_text(ui.lbl_price, "", 0x000000, &lv_font_montserrat_22);
-    ui_set_text(ui.lbl_unit, "", 0x000000, &lv_font_montserrat_22);
-    ui_set_text(ui.lbl_stock, "", 0x000000, &lv_font_montserrat_22);
+    ui_set_text(ui.lbl_name, "^__^", UI_ROLE_IDLE_TEXT);
+    ui_set_text(ui.lbl_price, "", UI_ROLE_IDLE_BLANK);
+    ui_set_text(ui.lbl_unit, "", UI_ROLE_IDLE_BLANK);
+    ui_set_text(ui.lbl_stock, "", UI_ROLE_IDLE_BLANK);
 }
 
 static void ui_show_error(UiContext &ui, const char *msg)
 {
-    ui_set_text(ui.lbl_name, "Chyba", 0xFF0000, &lv_font_montserrat_28);
-    ui_set_text(ui.lbl_price, msg, 0xFF0000, &lv_font_montserrat_28);
-    ui_set_text(ui.lbl_unit, "", 0x000000, &lv_font_montserrat_28);
-    ui_set_text(ui.lbl_stock, "", 0x000000, &lv_font_montserrat_28);
+    ui_set_text(ui.lbl_name, "Chyba", UI_ROLE_ERROR_TEXT);
+    ui_set_text(ui.lbl_price, msg, UI_ROLE_ERROR_TEXT);
+    ui_set_text(ui.lbl_unit, "", UI_ROLE_ERROR_BLANK);
+    ui_set_text(ui.lbl_stock, "", UI_ROLE_ERROR_BLANK);
 }
 
 static void ui_show_product(UiContext &ui, const ProductData &p)
 {
     char buf[128];
 
-    ui_set_text(ui.lbl_name, p.name, 0xFFFFFF, &lv_font_montserrat_24);
+    ui_set_text(ui.lbl_name, p.name, UI_ROLE_PRODUCT_NAME);
 
     snprintf(buf, sizeof(buf), "Cena: %.2f Kc", static_cast<double>(p.price));
-    ui_set_text(ui.lbl_price, buf, 0x00FF00, &lv_font_montserrat_38);
+    ui_set_text(ui.lbl_price, buf, UI_ROLE_PRODUCT_PRICE);
 
     if (p.unitOfMeasure[0] != '\0' && p.unitCoef > 0.0f) {
         snprintf(buf, sizeof(buf), "Cena za %s: %.2f Kc",
                  p.unitOfMeasure, static_cast<double>(p.price * p.unitCoef));
-        ui_set_text(ui.lbl_unit, buf, 0xFFFFFF, &lv_font_montserrat_18);
+        ui_set_text(ui.lbl_unit, buf, UI_ROLE_PRODUCT_DETAIL);
     } else {
-        ui_set_text(ui.lbl_unit, "", 0xFFFFFF, &lv_font_montserrat_18);
+        ui_set_text(ui.lbl_unit, "", UI_ROLE_PRODUCT_DETAIL);
     }
     snprintf(buf, sizeof(buf), "Skladem: %u ks", static_cast<unsigned>(p.stock));
-    ui_set_text(ui.lbl_stock, buf, 0xFFFFFF, &lv_font_montserrat_18);
+    ui_set_text(ui.lbl_stock, buf, UI_ROLE_PRODUCT_DETAIL);
+}
+
+static void ui_show_snapshot(UiContext &ui, const UiSnapshot &snapshot)
+{
+    if (snapshot.type == PRODUCT_DATA) {
+        ui_show_product(ui, snapshot.product);
+    } else {
+        ui_show_error(ui, print_error_text(snapshot.error));
+    }
 }
 
-static void ui_handle_message(UiContext &ui, const PrintMessage &msg)
+static void frame_fold_message(UiContext &ui, PendingFrame &frame, const PrintMessage &msg)
 {
+    frame.received++;
+
     switch (msg.type) {
     case WIFI_STATUS:
         ui.wifi_connected = msg.data.wifi.connected;
@@ -155,24 +278,105 @@ static void ui_handle_message(UiContext &ui, const PrintMessage &msg)
         } else {
             ui.ip_suffix = -1;
         }
-        ui_render_status(ui);
+        frame.status_dirty = true;
         break;
 
     case MQTT_STATUS:
         ui.mqtt_connected = msg.data.mqtt.connected;
-        ui_render_status(ui);
+        frame.status_dirty = true;
         break;
 
     case ERROR_MSG:
-        ui_show_error(ui, msg.data.error.msg);
-        break;
-
     case PRODUCT_DATA:
-        ui_show_product(ui, msg.data.product);
+        // only the newest screen is drawn, a superseded product gives its slot back right away
+        if (frame.has_screen && frame.screen.type == PRODUCT_DATA) {
+            product_pool_release(frame.screen.data.product_slot);
+        }
+        frame.screen = msg;
+        frame.has_screen = true;
         break;
     }
 }
 
+static void frame_discard(const PendingFrame &frame)
+{
+    if (frame.has_screen && frame.screen.type == PRODUCT_DATA) {
+        product_pool_release(frame.screen.data.product_slot);
+    }
+}
+
+static void frame_collect(UiContext &ui, PendingFrame &frame, PrintChannel &print)
+{
+    PrintMessage msg{};
+    while (print.receive(msg, 0)) {
+        frame_fold_message(ui, frame, msg);
+    }
+}
+
+static void frame_render(UiContext &ui, const PendingFrame &frame, const DisplayDevice &device)
+{
+    uint32_t rendered = 0;
+    const DisplayStats before = device.stats();
+
+    if (frame.status_dirty) {
+        ui_render_status(ui);
+        rendered++;
+    }
+
+    if (frame.has_screen) {
+        s_snapshot.type = frame.screen.type;
+        if (frame.screen.type == PRODUCT_DATA) {
+            s_snapshot.product = product_pool_get(frame.screen.data.product_slot);
+            product_pool_release(frame.screen.data.product_slot);
+        } else {
+            s_snapshot.error = frame.screen.data.error;
+        }
+        s_snapshot.magic = UI_SNAPSHOT_MAGIC;
+
+        ui_show_snapshot(ui, s_snapshot);
+        rendered++;
+
+        const DisplayStats after = device.stats();
+        ESP_LOGD(TAG, "Screen invalidated %lu areas (%llu bytes flushed since previous screen)",
+                 (unsigned long)(after.invalidated_areas - before.invalidated_areas),
+                 (unsigned long long)(after.flushed_bytes - s_last_screen_flushed_bytes));
+        s_last_screen_flushed_bytes = after.flushed_bytes;
+    }
+
+    if (frame.received > rendered) {
+        const uint32_t skipped = frame.received - rendered;
+        const uint32_t total = s_skipped_frames.fetch_add(skipped, std::memory_order_relaxed) + skipped;
+        ESP_LOGD(TAG, "Coalesced %lu messages into %lu renders (skipped total: %lu)",
+                 (unsigned long)frame.received, (unsigned long)rendered, (unsigned long)total);
+    }
+}
+
+static void note_activity(DisplayDevice &device)
+{
+    s_last_activity_us.store(esp_timer_get_time(), std::memory_order_relaxed);
+    device.backlight_restore();
+}
+
+static void on_scan_activity(void *handler_args, esp_event_base_t base, int32_t id, void *event_data)
+{
+    note_activity(*static_cast<DisplayDevice *>(handler_args));
+}
+
+static void idle_dim_poll(DisplayDevice &device)
+{
+#if CONFIG_DISPLAY_IDLE_DIM_S > 0
+    const int64_t idle_us = esp_timer_get_time() - s_last_activity_us.load(std::memory_order_relaxed);
+    if (idle_us >= CONFIG_DISPLAY_IDLE_DIM_S * 1000000LL) {
+        device.backlight_dim();
+    }
+#endif
+}
+
+uint32_t display_task_skipped_frames()
+{
+    return s_skipped_frames.load(std::memory_order_relaxed);
+}
+
 [[noreturn]] void display_task(void *pvParameters)
 {
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
@@ -181,6 +385,7 @@ static void ui_handle_message(UiContext &ui, const PrintMessage &msg)
 
     const auto* params = static_cast<const DisplayTaskParams*>(pvParameters);
     DisplayDevice& device = params->device;
+    heap_audit_watch_current_task();
 
     ESP_ERROR_CHECK(device.init());
 
@@ -188,9 +393,35 @@ static void ui_handle_message(UiContext &ui, const PrintMessage &msg)
 
     lvgl_port_lock(0);
     ui_init(ui);
+    if (s_snapshot.magic == UI_SNAPSHOT_MAGIC) {
+        ui_show_snapshot(ui, s_snapshot);
+    }
     lvgl_port_unlock();
 
+#if CONFIG_DISPLAY_FRAME_BENCHMARK
+    const esp_err_t bench_err = device.run_frame_benchmark(CONFIG_DISPLAY_FRAME_BENCHMARK_FRAMES);
+    if (bench_err != ESP_OK) {
+        ESP_LOGW(TAG, "Frame benchmark failed: %s", esp_err_to_name(bench_err));
+    }
+#endif
+
+    esp_event_handler_instance_t scan_handler = nullptr;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(APP_EVENT, APP_EVENT_BARCODE_SCANNED,
+                                                        &on_scan_activity, &device, &scan_handler));
+    s_last_activity_us.store(esp_timer_get_time(), std::memory_order_relaxed);
+
+    bool first_frame_reported = false;
+
     for (;;) {
+        if (!first_frame_reported && device.stats().frames > 0) {
+            const DisplayStats stats = device.stats();
+            ESP_LOGI(TAG, "Wake-to-first-frame: %lu ms (%s)",
+                     (unsigned long)(stats.first_frame_us / 1000),
+                     stats.resumed ? "panel resume" : "full init");
+            boot_timeline_mark(BOOT_STAGE_FIRST_FRAME);
+            first_frame_reported = true;
+        }
+
         const EventBits_t req_bits = xEventGroupWaitBits(
             params->eventGroup,
             BIT_REQ_STOP,
@@ -200,33 +431,59 @@ static void ui_handle_message(UiContext &ui, const PrintMessage &msg)
         );
 
         if ((req_bits & BIT_REQ_STOP) != 0) {
-            PrintMessage pending_msg{};
-            if (xQueueReceive(params->printQueue, &pending_msg, 0) == pdTRUE) {
+            PendingFrame pending{};
+            frame_collect(ui, pending, params->print);
+            if (pending.received > 0) {
                 if (lvgl_port_lock(1000)) {
-                    ui_handle_message(ui, pending_msg);
+                    frame_render(ui, pending, device);
                     lvgl_port_unlock();
                 } else {
                     ESP_LOGW(TAG, "LVGL lock timeout during STOP, skipping pending frame");
+                    frame_discard(pending);
                 }
             }
 
-            ESP_LOGI(TAG, "Display task ready, acknowledging STOP and suspending");
+            esp_event_handler_instance_unregister(APP_EVENT, APP_EVENT_BARCODE_SCANNED, scan_handler);
+            scan_handler = nullptr;
+
+            ESP_LOGI(TAG, "Display task ready, acknowledging STOP");
             xEventGroupSetBits(params->eventGroup, BIT_ACK_DISPLAY);
-            vTaskSuspend(nullptr);
+
+            // a level, not an edge, so a WAKE that came before this point is not missed
+            xEventGroupWaitBits(params->eventGroup, BIT_REQ_RESUME, pdFALSE, pdFALSE, portMAX_DELAY);
+
+            // only reached when a WAKE cancelled the SLEEP before deep sleep
+            ESP_ERROR_CHECK(esp_event_handler_instance_register(APP_EVENT, APP_EVENT_BARCODE_SCANNED,
+                                                                &on_scan_activity, &device, &scan_handler));
         }
 
         PrintMessage msg{};
-        if (xQueueReceive(params->printQueue, &msg, pdMS_TO_TICKS(200)) != pdTRUE) {
+        if (!params->print.receive(msg, pdMS_TO_TICKS(200))) {
+            idle_dim_poll(device);
             continue;
         }
 
+        // a burst only needs the newest screen and the folded status, render once
+        PendingFrame frame{};
+        frame_fold_message(ui, frame, msg);
+        frame_collect(ui, frame, params->print);
+
         if (!lvgl_port_lock(1000)) {
             ESP_LOGW(TAG, "LVGL lock timeout, skipping frame");
+            s_skipped_frames.fetch_add(frame.received, std::memory_order_relaxed);
+            frame_discard(frame);
             continue;
         }
 
-        ui_handle_message(ui, msg);
+        frame_render(ui, frame, device);
 
         lvgl_port_unlock();
+
+        if (frame.has_screen) {
+            // the answer to a scan is on the panel, closes the allocation audit window
+            heap_audit_scan_end();
+            scan_latency_end();
+            note_activity(device);
+        }
     }
 }
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+
+// Streaming applier for "OPD1" patches made by tools/make_delta_ota.py.
+//
+// header: "OPD1" | base app_elf_sha256[32] | target image sha256[32] | target size u32
+// ops (little endian):
+//   0x00 END
+//   0x01 COPY   base_off u32, len u32                 target = base
+//   0x02 ADD    base_off u32, len u32, runs...        target = base + diff, runs are
+//               skip u16, lit u16, diff[lit]          (skip bytes copied unchanged)
+//   0x03 INSERT len u32, data[len]                    target = data
+class DeltaPatch {
+public:
+    using OutputFn = esp_err_t (*)(void* ctx, const uint8_t* data, size_t len);
+
+    static constexpr size_t MAGIC_LEN = 4;
+    static bool is_patch(const uint8_t* data, size_t len);
+
+    DeltaPatch() = default;
+    ~DeltaPatch();
+
+    DeltaPatch(const DeltaPatch&) = delete;
+    DeltaPatch& operator=(const DeltaPatch&) = delete;
+
+    // base is the running app partition, output receives the reconstructed image in order
+    void begin(const esp_partition_t* base, OutputFn output, void* output_ctx);
+    esp_err_t feed(const uint8_t* data, size_t len);
+
+    // END seen, size and SHA-256 of the output match the header
+    esp_err_t finish();
+
+private:
+    enum class State : uint8_t { HEADER, OPCODE, ARGS, ADD_RUN, ADD_LITERAL, INSERT, DONE };
+
+    bool collect(const uint8_t*& data, size_t& len, size_t need);
+    esp_err_t emit(const uint8_t* data, size_t len);
+    esp_err_t copy_base(uint32_t offset, uint32_t len);
+    esp_err_t check_header();
+    esp_err_t start_op();
+
+    const esp_partition_t* base_ = nullptr;
+    OutputFn output_ = nullptr;
+    void* output_ctx_ = nullptr;
+    mbedtls_sha256_context sha_{};
+    bool sha_started_ = false;
+
+    State state_ = State::HEADER;
+    uint8_t opcode_ = 0;
+    uint8_t args_[72]{};
+    size_t args_len_ = 0;
+
+    uint32_t base_pos_ = 0;
+    uint32_t remaining_ = 0;
+    uint16_t literal_remaining_ = 0;
+
+    uint8_t target_sha_[32]{};
+    uint32_t target_size_ = 0;
+    uint32_t out_size_ = 0;
+
+    uint8_t scratch_[256]{};
+};
@@ -4,3 +4,6 @@
 #include <cstring>
 
 bool parse_product_json(const char* json_str, size_t len, ProductData *out_data);
+
+// batch reply entry, a product object that also names its "barcode"
+bool parse_product_entry_json(const char* json_str, size_t len, char* barcode, size_t barcode_len, ProductData *out_data);
@@ -2,6 +2,21 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <cstddef>
+#include "esp_err.h"
+#include "sdkconfig.h"
+#include "print_channel.h"
 
-void mqtt_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue);
+void mqtt_service_init(PrintChannel& print, QueueHandle_t controlQueue);
 void mqtt_service_stop();
+
+// enqueue builds the whole packet in the client's out buffer: fixed header (up to 5 bytes),
+// topic length (2) and <MQTT_TOPIC_STATUS>/<12 hex digit client id>/<report>
+constexpr size_t mqtt_service_status_payload_max(const size_t report_len)
+{
+    return CONFIG_MQTT_BUFFER_SIZE - 5 - 2 - (sizeof(CONFIG_MQTT_TOPIC_STATUS) - 1) - 1 - 12 - 1 - report_len;
+}
+
+// queues a QoS 0 report on <MQTT_TOPIC_STATUS>/<client id>/<report>, safe from any task,
+// payloads over mqtt_service_status_payload_max() are refused with ESP_ERR_INVALID_SIZE
+esp_err_t mqtt_service_publish_status(const char* report, const char* payload, size_t len);
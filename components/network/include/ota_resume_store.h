@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "esp_err.h"
+
+// progress of an interrupted full-image download, kept in NVS across reconnects and reboots
+struct OtaResumeState {
+    char url[128];
+    char validator[64];         // strong ETag or Last-Modified of the image, sent back as If-Range
+    uint32_t image_size;        // 0 when the server did not send a length
+    uint32_t offset;            // bytes already written to the update partition
+    uint8_t digest[32];         // SHA-256 of those bytes
+};
+
+esp_err_t ota_resume_store_begin(const char* url, const char* validator, uint32_t image_size);
+esp_err_t ota_resume_store_checkpoint(uint32_t offset, const uint8_t digest[32]);
+esp_err_t ota_resume_store_load(OtaResumeState* state_out);
+void ota_resume_store_clear();
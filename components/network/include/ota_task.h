@@ -7,5 +7,6 @@ struct OtaTaskParams {
     char url[128];
 };
 
-
-[[noreturn]] void ota_task(void *pvParameters);
+// downloads and flashes in the background and restarts on success,
+// on failure clears BIT_OTA_RUNNING and deletes itself
+void ota_task(void *pvParameters);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "sdkconfig.h"
+#include "product_data.h"
+#include "events.h"
+
+// Decayed scan counts per barcode live in RTC memory and survive deep sleep, the product
+// cache itself is RAM and starts empty on every wake. After MQTT connects, the most
+// popular barcodes are fetched in one batched request so the first scans hit locally.
+#if CONFIG_PRODUCT_CACHE
+
+using Barcode = char[sizeof(ScanEvent::barcode)];
+
+// once per boot, ages the popularity counts by the RTC time spent asleep
+void product_cache_init();
+
+void product_cache_record_scan(const char* barcode);
+
+// false when missing or older than PRODUCT_CACHE_TTL_S
+bool product_cache_lookup(const char* barcode, ProductData& out);
+
+void product_cache_store(const char* barcode, const ProductData& product);
+
+// most popular barcodes first, those already cached are skipped
+size_t product_cache_top(Barcode* out, size_t max);
+
+// Incremental parser for the batch reply, a JSON array of product objects that each carry
+// their "barcode". Fed one MQTT fragment at a time, only one object is buffered.
+class ProductBatchParser {
+public:
+    using EntryFn = void (*)(const char* barcode, const ProductData& product);
+
+    static constexpr size_t ENTRY_BUFFER_SIZE = 512;
+
+    void begin(EntryFn entry);
+
+    // false on malformed input, the rest of the reply is ignored
+    bool feed(const char* data, size_t len);
+
+    // closing bracket seen
+    bool done() const { return depth_ == 0 && started_; }
+    uint32_t entries() const { return entries_; }
+
+private:
+    void finish_entry();
+
+    EntryFn entry_ = nullptr;
+    char buf_[ENTRY_BUFFER_SIZE]{};
+    size_t len_ = 0;
+    uint8_t depth_ = 0;
+    bool started_ = false;
+    bool in_string_ = false;
+    bool escape_ = false;
+    bool overflow_ = false;
+    uint32_t entries_ = 0;
+};
+
+#else
+
+inline void product_cache_init() {}
+inline void product_cache_record_scan(const char*) {}
+inline bool product_cache_lookup(const char*, ProductData&) { return false; }
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include "esp_transport.h"
+
+struct TlsSessionTransportConfig {
+    const char* ca_cert;
+    size_t ca_cert_len;
+    const char* client_cert;
+    size_t client_cert_len;
+    const char* client_key;
+    size_t client_key_len;
+    uint16_t default_port;
+};
+
+// esp_tls backed transport that offers the TLS session ticket kept in RTC memory,
+// so reconnects and deep sleep wakes can resume instead of doing a full mutual-TLS handshake
+esp_transport_handle_t tls_session_transport_create(const TlsSessionTransportConfig& config);
+
+// drops the cached ticket, the next connect does a full handshake
+void tls_session_transport_forget();
+
+// duration of the last successful handshake, -1 if none yet
+int64_t tls_session_last_handshake_us();
+
+// whether the last handshake offered a cached ticket
+bool tls_session_last_offered_ticket();
@@ -2,5 +2,9 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include "print_channel.h"
 
-void wifi_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue);
+void wifi_service_init(PrintChannel& print, QueueHandle_t controlQueue);
+
+// time from Wi-Fi start (or the last disconnect) to the last IP, -1 while not connected
+int64_t wifi_service_time_to_ip_us();
@@ -0,0 +1,259 @@
+#include "delta_patch.h"
+#include <algorithm>
+#include <cstring>
+#include "esp_app_desc.h"
+#include "esp_log.h"
+
+static const char *TAG = "delta_patch";
+
+static constexpr uint8_t PATCH_MAGIC[DeltaPatch::MAGIC_LEN] = { 'O', 'P', 'D', '1' };
+static constexpr size_t HEADER_LEN = DeltaPatch::MAGIC_LEN + 32 + 32 + 4;
+
+enum : uint8_t {
+    OP_END = 0x00,
+    OP_COPY = 0x01,
+    OP_ADD = 0x02,
+    OP_INSERT = 0x03,
+};
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint16_t read_u16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+bool DeltaPatch::is_patch(const uint8_t* data, const size_t len)
+{
+    return len >= MAGIC_LEN && memcmp(data, PATCH_MAGIC, MAGIC_LEN) == 0;
+}
+
+DeltaPatch::~DeltaPatch()
+{
+    if (sha_started_) {
+        mbedtls_sha256_free(&sha_);
+    }
+}
+
+void DeltaPatch::begin(const esp_partition_t* base, const OutputFn output, void* output_ctx)
+{
+    base_ = base;
+    output_ = output;
+    output_ctx_ = output_ctx;
+
+    mbedtls_sha256_init(&sha_);
+    mbedtls_sha256_starts(&sha_, 0);
+    sha_started_ = true;
+
+    state_ = State::HEADER;
+    args_len_ = 0;
+    out_size_ = 0;
+}
+
+bool DeltaPatch::collect(const uint8_t*& data, size_t& len, const size_t need)
+{
+    const size_t take = std::min(len, need - args_len_);
+    memcpy(args_ + args_len_, data, take);
+    args_len_ += take;
+    data += take;
+    len -= take;
+
+    if (args_len_ < need) {
+        return false;
+    }
+    args_len_ = 0;
+    return true;
+}
+
+esp_err_t DeltaPatch::emit(const uint8_t* data, const size_t len)
+{
+    if (out_size_ + len > target_size_) {
+        ESP_LOGE(TAG, "Patch output exceeds target size %lu", (unsigned long)target_size_);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    mbedtls_sha256_update(&sha_, data, len);
+    out_size_ += len;
+    return output_(output_ctx_, data, len);
+}
+
+esp_err_t DeltaPatch::copy_base(uint32_t offset, uint32_t len)
+{
+    if (offset > base_->size || len > base_->size - offset) {
+        ESP_LOGE(TAG, "Base range 0x%lx+%lu outside running partition", (unsigned long)offset, (unsigned long)len);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (len > 0) {
+        const size_t n = std::min<size_t>(len, sizeof(scratch_));
+        esp_err_t err = esp_partition_read(base_, offset, scratch_, n);
+        if (err == ESP_OK) {
+            err = emit(scratch_, n);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+        offset += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t DeltaPatch::check_header()
+{
+    if (!is_patch(args_, HEADER_LEN)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // the patch is only valid against the exact build that is running
+    const esp_app_desc_t* running = esp_app_get_description();
+    if (memcmp(args_ + MAGIC_LEN, running->app_elf_sha256, 32) != 0) {
+        ESP_LOGE(TAG, "Patch was made against a different base image");
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    memcpy(target_sha_, args_ + MAGIC_LEN + 32, sizeof(target_sha_));
+    target_size_ = read_u32(args_ + MAGIC_LEN + 64);
+    ESP_LOGI(TAG, "Applying delta patch, target image %lu bytes", (unsigned long)target_size_);
+    return ESP_OK;
+}
+
+esp_err_t DeltaPatch::start_op()
+{
+    switch (opcode_) {
+        case OP_COPY:
+            state_ = State::OPCODE;
+            return copy_base(read_u32(args_), read_u32(args_ + 4));
+
+        case OP_ADD:
+            base_pos_ = read_u32(args_);
+            remaining_ = read_u32(args_ + 4);
+            if (base_pos_ > base_->size || remaining_ > base_->size - base_pos_) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            state_ = (remaining_ > 0) ? State::ADD_RUN : State::OPCODE;
+            return ESP_OK;
+
+        case OP_INSERT:
+            remaining_ = read_u32(args_);
+            state_ = (remaining_ > 0) ? State::INSERT : State::OPCODE;
+            return ESP_OK;
+
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+esp_err_t DeltaPatch::feed(const uint8_t* data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+
+    while (len > 0 && err == ESP_OK) {
+        switch (state_) {
+            case State::HEADER:
+                if (collect(data, len, HEADER_LEN)) {
+                    err = check_header();
+                    state_ = State::OPCODE;
+                }
+                break;
+
+            case State::OPCODE:
+                opcode_ = *data++;
+                --len;
+                if (opcode_ == OP_END) {
+                    state_ = State::DONE;
+                } else if (opcode_ > OP_INSERT) {
+                    ESP_LOGE(TAG, "Unknown patch op 0x%02x", opcode_);
+                    err = ESP_ERR_INVALID_ARG;
+                } else {
+                    state_ = State::ARGS;
+                }
+                break;
+
+            case State::ARGS:
+                if (collect(data, len, (opcode_ == OP_INSERT) ? 4 : 8)) {
+                    err = start_op();
+                }
+                break;
+
+            case State::ADD_RUN:
+                if (collect(data, len, 4)) {
+                    const uint16_t skip = read_u16(args_);
+                    literal_remaining_ = read_u16(args_ + 2);
+                    if (static_cast<uint32_t>(skip) + literal_remaining_ > remaining_) {
+                        err = ESP_ERR_INVALID_ARG;
+                        break;
+                    }
+                    err = copy_base(base_pos_, skip);
+                    base_pos_ += skip;
+                    remaining_ -= skip;
+                    if (literal_remaining_ > 0) {
+                        state_ = State::ADD_LITERAL;
+                    } else if (remaining_ == 0) {
+                        state_ = State::OPCODE;
+                    }
+                }
+                break;
+
+            case State::ADD_LITERAL: {
+                const size_t n = std::min({ len, static_cast<size_t>(literal_remaining_), sizeof(scratch_) });
+                err = esp_partition_read(base_, base_pos_, scratch_, n);
+                if (err != ESP_OK) {
+                    break;
+                }
+                for (size_t i = 0; i < n; ++i) {
+                    scratch_[i] = static_cast<uint8_t>(scratch_[i] + data[i]);
+                }
+                err = emit(scratch_, n);
+
+                data += n;
+                len -= n;
+                base_pos_ += n;
+                remaining_ -= n;
+                literal_remaining_ -= n;
+                if (literal_remaining_ == 0) {
+                    state_ = (remaining_ > 0) ? State::ADD_RUN : State::OPCODE;
+                }
+                break;
+            }
+
+            case State::INSERT: {
+                const size_t n = std::min<size_t>(len, remaining_);
+                err = emit(data, n);
+                data += n;
+                len -= n;
+                remaining_ -= n;
+                if (remaining_ == 0) {
+                    state_ = State::OPCODE;
+                }
+                break;
+            }
+
+            case State::DONE:
+                ESP_LOGE(TAG, "Trailing data after END");
+                err = ESP_ERR_INVALID_SIZE;
+                break;
+        }
+    }
+
+    return err;
+}
+
+esp_err_t DeltaPatch::finish()
+{
+    if (state_ != State::DONE || out_size_ != target_size_) {
+        ESP_LOGE(TAG, "Patch incomplete (%lu of %lu bytes)", (unsigned long)out_size_, (unsigned long)target_size_);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha_, digest);
+    if (memcmp(digest, target_sha_, sizeof(digest)) != 0) {
+        ESP_LOGE(TAG, "Reconstructed image hash mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
@@ -76,4 +76,28 @@ bool parse_product_json(const char *json_str, size_t len, ProductData *out_data)
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+bool parse_product_entry_json(const char *json_str, size_t len, char *barcode, size_t barcode_len, ProductData *out_data)
+{
+    if (!parse_product_json(json_str, len, out_data)) {
+        return false;
+    }
+
+    jsmn_parser p;
+    jsmn_init(&p);
+
+    jsmntok_t t[32];
+
+    int r = jsmn_parse(&p, json_str, len, t, sizeof(t) / sizeof(t[0]));
+
+    barcode[0] = '\0';
+    for (int i = 1; i + 1 < r; i++) {
+        if (json_eq(json_str, t[i], "barcode") && t[i+1].type == JSMN_STRING) {
+            json_copy_val(json_str, t[i+1], barcode, barcode_len);
+            break;
+        }
+    }
+
+    return true;
+}
@@ -7,11 +7,16 @@
 #include "esp_timer.h"
 #include "mqtt_client.h"
 #include "esp_event.h"
-#include "print_message.h"
+#include "print_channel.h"
 #include "json_parser.h"
 #include "product_data.h"
+#include "product_cache.h"
 #include "events.h"
 #include "esp_mac.h"
+#include "power_manager.h"
+#include "tls_session_transport.h"
+#include "boot_timeline.h"
+#include "heap_audit.h"
 
 extern const uint8_t ca_cert_start[]      asm("_binary_ca_crt_start");
 extern const uint8_t ca_cert_end[]        asm("_binary_ca_crt_end");
@@ -25,11 +30,13 @@ static const char *TAG = "mqtt_service";
 constexpr size_t MAC_HEX_LEN = 12;
 constexpr size_t TOPIC_BASE_LEN = sizeof(CONFIG_MQTT_REQ_TOPIC_PREFIX) + MAC_HEX_LEN + 2;
 constexpr size_t TOPIC_BUFFER_SIZE = (TOPIC_BASE_LEN + CONFIG_MAX_BARCODE_BUFFER_SIZE) * 2;
+// retained separately from the wake/sleep state that is retained on the control topic itself
+constexpr char SCHEDULE_TOPIC[] = CONFIG_MQTT_TOPIC_CONTROL "/schedule";
 constexpr uint64_t MQTT_INIT_TIMEOUT_US = 5ULL * 1000ULL * 1000ULL;
 
 static struct {
     esp_mqtt_client_handle_t client{};
-    QueueHandle_t print_queue{};
+    PrintChannel* print{};
     QueueHandle_t control_queue{};
     esp_event_handler_instance_t barcode_handler{};
     esp_timer_handle_t init_timer{};
@@ -38,6 +45,12 @@ static struct {
     std::atomic<bool> init_timeout_notified;
     char topic_base[TOPIC_BASE_LEN]{};
     char client_id[13]{};
+    uint32_t scan_cursor{0};
+#if CONFIG_PRODUCT_CACHE
+    ProductBatchParser batch;
+    bool batch_active{false};
+    bool warmup_sent{false};
+#endif
 } s_ctx;
 
 static bool is_broker_unreachable(const esp_mqtt_event_t* event) {
@@ -46,10 +59,7 @@ static bool is_broker_unreachable(const esp_mqtt_event_t* event) {
 }
 
 static void queue_mqtt_status(bool connected) {
-    PrintMessage msg{};
-    msg.type = MQTT_STATUS;
-    msg.data.mqtt.connected = connected;
-    xQueueSend(s_ctx.print_queue, &msg, 0);
+    s_ctx.print->post_mqtt(connected);
 }
 
 static void publish_control(ControlType type, const char* payload = nullptr, size_t len = 0) {
@@ -66,7 +76,9 @@ static void publish_control(ControlType type, const char* payload = nullptr, siz
         msg.payload[0] = '\0';
     }
 
-    xQueueSend(s_ctx.control_queue, &msg, 0);
+    if (xQueueSend(s_ctx.control_queue, &msg, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Control queue full, control type %d dropped", static_cast<int>(type));
+    }
 }
 
 static void stop_init_timer() {
@@ -98,47 +110,178 @@ static void start_init_timer() {
     }
 }
 
-static void handle_product_json(const char* payload, size_t len) {
+static void handle_product_reply(const char* payload, size_t len) {
     char json[512];
     const size_t cpy_len = (len < sizeof(json) - 1) ? len : (sizeof(json) - 1);
     memcpy(json, payload, cpy_len);
     json[cpy_len] = '\0';
 
-    ProductData product{};
+    uint8_t slot = 0;
+    ProductData* product = product_pool_acquire(slot);
+    if (product == nullptr) {
+        ESP_LOGW(TAG, "Product pool exhausted, reply dropped");
+        return;
+    }
+
+    // parsed straight into the pool slot, only its index goes through the queue
     PrintMessage msg{};
-    if (parse_product_json(json, cpy_len, &product)) {
-        if (product.valid) {
+    if (parse_product_json(json, cpy_len, product)) {
+        if (product->valid) {
             msg.type = PRODUCT_DATA;
-            msg.data.product = product;
-            xQueueSend(s_ctx.print_queue, &msg, 0);
-        } else {
-            msg.type = ERROR_MSG;
-            strlcpy(msg.data.error.msg, "Zavolejte prosim obsluhu ->\nprodukt chybi v db", sizeof(msg.data.error.msg));
-            xQueueSend(s_ctx.print_queue, &msg, 0);
+            msg.data.product_slot = slot;
+            s_ctx.print->post_screen(msg);
+            return;
         }
+        msg.type = ERROR_MSG;
+        msg.data.error = PRINT_ERR_PRODUCT_MISSING;
     } else {
         msg.type = ERROR_MSG;
-        strlcpy(msg.data.error.msg, "Zavolejte prosim obsluhu ->\nnevalidni format dat", sizeof(msg.data.error.msg));
-        xQueueSend(s_ctx.print_queue, &msg, 0);
+        msg.data.error = PRINT_ERR_INVALID_DATA;
     }
+    product_pool_release(slot);
+    s_ctx.print->post_screen(msg);
+}
+
+#if CONFIG_PRODUCT_CACHE
+constexpr char BATCH_TOPIC_SUFFIX[] = "batch";
+
+// payload is a JSON array of barcodes, the reply comes back on topic_base as an array of products
+static void request_warmup(esp_mqtt_client_handle_t client) {
+    if (s_ctx.warmup_sent) {
+        return;
+    }
+
+    static Barcode top[CONFIG_PRODUCT_CACHE_SLOTS];
+    const size_t count = product_cache_top(top, CONFIG_PRODUCT_CACHE_SLOTS);
+    if (count == 0) {
+        s_ctx.warmup_sent = true;
+        return;
+    }
+
+    static char payload[CONFIG_PRODUCT_CACHE_SLOTS * (sizeof(Barcode) + 3) + 2];
+    size_t len = 0;
+    payload[len++] = '[';
+    for (size_t i = 0; i < count; ++i) {
+        len += snprintf(payload + len, sizeof(payload) - len, "%s\"%s\"", (i > 0) ? "," : "", top[i]);
+    }
+    payload[len++] = ']';
+
+    char topic[TOPIC_BASE_LEN + sizeof(BATCH_TOPIC_SUFFIX) + 1];
+    snprintf(topic, sizeof(topic), "%s/%s", s_ctx.topic_base, BATCH_TOPIC_SUFFIX);
+
+    if (esp_mqtt_client_publish(client, topic, payload, static_cast<int>(len), 1, 0) < 0) {
+        ESP_LOGW(TAG, "Cache warm-up request failed, retrying on next connect");
+        return;
+    }
+    s_ctx.warmup_sent = true;
+    ESP_LOGD(TAG, "Requested %u popular products", (unsigned)count);
+}
+
+static void on_batch_entry(const char* barcode, const ProductData& product) {
+    product_cache_store(barcode, product);
+}
+
+// a batch reply is longer than the client buffer, esp-mqtt hands it over in fragments
+static void feed_batch(const esp_mqtt_event_t* event) {
+    if (!s_ctx.batch_active) {
+        return;
+    }
+
+    if (!s_ctx.batch.feed(event->data, event->data_len)) {
+        ESP_LOGW(TAG, "Malformed batch reply, %lu products cached", (unsigned long)s_ctx.batch.entries());
+        s_ctx.batch_active = false;
+        return;
+    }
+
+    if (event->current_data_offset + event->data_len >= event->total_data_len) {
+        s_ctx.batch_active = false;
+        ESP_LOGI(TAG, "Cache warmed with %lu products", (unsigned long)s_ctx.batch.entries());
+    }
+}
+
+// runs on the event loop next to the MQTT task, counted as the second producer in PRODUCT_POOL_PRODUCERS
+static bool serve_cached(const char* barcode) {
+    uint8_t slot = 0;
+    ProductData* product = product_pool_acquire(slot);
+    if (product == nullptr) {
+        return false;
+    }
+
+    if (!product_cache_lookup(barcode, *product)) {
+        product_pool_release(slot);
+        return false;
+    }
+
+    PrintMessage msg{};
+    if (product->valid) {
+        msg.type = PRODUCT_DATA;
+        msg.data.product_slot = slot;
+    } else {
+        product_pool_release(slot);
+        msg.type = ERROR_MSG;
+        msg.data.error = PRINT_ERR_PRODUCT_MISSING;
+    }
+    s_ctx.print->post_screen(msg);
+    return true;
+}
+#endif
+
+static void handle_product_json(const char* payload, size_t len) {
+    heap_audit_handler_begin(HEAP_AUDIT_PRODUCT_REPLY);
+    handle_product_reply(payload, len);
+    heap_audit_handler_end(HEAP_AUDIT_PRODUCT_REPLY);
+}
+
+static void subscribe_topics(esp_mqtt_client_handle_t client) {
+    const esp_mqtt_topic_t topics[] = {
+        { .filter = s_ctx.topic_base, .qos = 1 },
+        { .filter = CONFIG_MQTT_TOPIC_CONTROL, .qos = 1 },
+        { .filter = SCHEDULE_TOPIC, .qos = 1 },
+    };
+
+    const int msg_id = esp_mqtt_client_subscribe_multiple(client, topics, sizeof(topics) / sizeof(topics[0]));
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Subscribe failed");
+        return;
+    }
+
+    ESP_LOGD(TAG, "Subscribed to topics: '%s', '%s', '%s'", s_ctx.topic_base, CONFIG_MQTT_TOPIC_CONTROL, SCHEDULE_TOPIC);
 }
 
 static void mqtt_event_handler(void* handler_args, esp_event_base_t base, int32_t event_id, void* event_data) {
     const auto *event = static_cast<const esp_mqtt_event_t*>(event_data);
+    PowerLockGuard pm_lock(POWER_LOCK_MQTT);
 
     switch (event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGD(TAG, "MQTT_EVENT_CONNECTED");
             s_ctx.unreachable_notified = false;
-            s_ctx.control_state_received = false;
             s_ctx.init_timeout_notified = false;
             queue_mqtt_status(true);
+            boot_timeline_mark(BOOT_STAGE_TLS);
+
+            // the broker kept our subscriptions and queues control messages for us,
+            // a resubscribe is only needed to get the retained state we have not seen yet
+            if (event->session_present && s_ctx.control_state_received) {
+                ESP_LOGD(TAG, "Session present, skipping resubscribe");
+                boot_timeline_mark(BOOT_STAGE_SUBSCRIBED);
+#if CONFIG_PRODUCT_CACHE
+                request_warmup(event->client);
+#endif
+                break;
+            }
 
-            esp_mqtt_client_subscribe_single(event->client, s_ctx.topic_base, 1);
-            esp_mqtt_client_subscribe_single(event->client, CONFIG_MQTT_TOPIC_CONTROL, 1);
+            s_ctx.control_state_received = false;
+            subscribe_topics(event->client);
             start_init_timer();
+#if CONFIG_PRODUCT_CACHE
+            // after the subscribe, so the broker has the reply topic when the batch comes back
+            request_warmup(event->client);
+#endif
+            break;
 
-            ESP_LOGD(TAG, "Subscribed to topics: '%s', '%s'", s_ctx.topic_base, CONFIG_MQTT_TOPIC_CONTROL);
+        case MQTT_EVENT_SUBSCRIBED:
+            boot_timeline_mark(BOOT_STAGE_SUBSCRIBED);
             break;
 
         case MQTT_EVENT_DISCONNECTED:
@@ -148,6 +291,20 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base, int32_
             break;
 
         case MQTT_EVENT_DATA:
+#if CONFIG_PRODUCT_CACHE
+            if (event->current_data_offset > 0) {
+                feed_batch(event);
+                break;
+            }
+            if (event->data_len > 0 && event->data[0] == '[' &&
+                event->topic_len == static_cast<int>(strlen(s_ctx.topic_base)) &&
+                memcmp(event->topic, s_ctx.topic_base, event->topic_len) == 0) {
+                s_ctx.batch.begin(&on_batch_entry);
+                s_ctx.batch_active = true;
+                feed_batch(event);
+                break;
+            }
+#endif
             if (event->topic_len == static_cast<int>(strlen(s_ctx.topic_base)) &&
                 memcmp(event->topic, s_ctx.topic_base, event->topic_len) == 0) {
                 handle_product_json(event->data, event->data_len);
@@ -168,10 +325,17 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base, int32_
                 else if (event->data_len == 12 && memcmp(event->data, "conf_scanner", 12) == 0) {
                     publish_control(ControlType::SCANNER_CONF);
                 }
+                else if (event->data_len == 5 && memcmp(event->data, "stats", 5) == 0) {
+                    publish_control(ControlType::STATS);
+                }
                 else if (event->data_len > 8 && memcmp(event->data, "https://", 8) == 0) {
                     publish_control(ControlType::FIRMWARE, event->data, event->data_len);
                 }
             }
+            else if (event->topic_len == static_cast<int>(strlen(SCHEDULE_TOPIC)) &&
+                     memcmp(event->topic, SCHEDULE_TOPIC, event->topic_len) == 0 && event->data_len > 0) {
+                publish_control(ControlType::SCHEDULE, event->data, event->data_len);
+            }
             break;
 
         case MQTT_EVENT_ERROR:
@@ -194,25 +358,38 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base, int32_
 static void on_barcode_scanned(void* handler_args, esp_event_base_t base, int32_t id, void* event_data) {
     if (s_ctx.client == nullptr) return;
 
-    const auto* ev = static_cast<const ScanEvent*>(event_data);
-
-    ESP_LOGD(TAG, "Processing Barcode: %s", ev->barcode);
+    PowerLockGuard pm_lock(POWER_LOCK_MQTT);
 
     static char full_topic[TOPIC_BUFFER_SIZE];
 
-    int written = snprintf(full_topic, TOPIC_BUFFER_SIZE, "%s/%s", s_ctx.topic_base, ev->barcode);
+    heap_audit_handler_begin(HEAP_AUDIT_SCAN_REQUEST);
+    ScanEvent ev{};
+    while (scan_ring_pop(s_ctx.scan_cursor, ev)) {
+        ESP_LOGD(TAG, "Processing Barcode: %s", ev.barcode);
+
+        product_cache_record_scan(ev.barcode);
+#if CONFIG_PRODUCT_CACHE
+        if (serve_cached(ev.barcode)) {
+            ESP_LOGD(TAG, "Served from cache");
+            continue;
+        }
+#endif
+
+        int written = snprintf(full_topic, TOPIC_BUFFER_SIZE, "%s/%s", s_ctx.topic_base, ev.barcode);
 
-    if (written > 0 && written < static_cast<int>(TOPIC_BUFFER_SIZE)) {
-        int msg_id = esp_mqtt_client_publish(s_ctx.client, full_topic, "", 0, 1, 0);
-        if (msg_id != -1) {
-            ESP_LOGD(TAG, "Published to '%s' (Msg ID: %d)", full_topic, msg_id);
-        } else {
-            ESP_LOGE(TAG, "Publish failed");
+        if (written > 0 && written < static_cast<int>(TOPIC_BUFFER_SIZE)) {
+            int msg_id = esp_mqtt_client_publish(s_ctx.client, full_topic, "", 0, 1, 0);
+            if (msg_id != -1) {
+                ESP_LOGD(TAG, "Published to '%s' (Msg ID: %d)", full_topic, msg_id);
+            } else {
+                ESP_LOGE(TAG, "Publish failed");
+            }
         }
     }
+    heap_audit_handler_end(HEAP_AUDIT_SCAN_REQUEST);
 }
 
-void mqtt_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue) {
+void mqtt_service_init(PrintChannel& print, QueueHandle_t controlQueue) {
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
 
     if (s_ctx.client != nullptr) {
@@ -220,11 +397,13 @@ void mqtt_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue) {
         return;
     }
 
-    s_ctx.print_queue = printQueue;
+    s_ctx.print = &print;
     s_ctx.control_queue = controlQueue;
     s_ctx.unreachable_notified = false;
     s_ctx.control_state_received = false;
     s_ctx.init_timeout_notified = false;
+    s_ctx.scan_cursor = scan_ring_head();
+    product_cache_init();
 
     uint8_t mac[6]{};
     ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
@@ -240,6 +419,23 @@ void mqtt_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue) {
 
     esp_mqtt_client_config_t cfg{};
     cfg.broker.address.uri = CONFIG_MQTT_BROKER_URI;
+
+#if CONFIG_MQTT_TLS_SESSION_RESUMPTION
+    // certificates go to the resumption transport, the client destroys it with itself
+    TlsSessionTransportConfig tls_cfg{};
+    tls_cfg.ca_cert = (const char *)ca_cert_start;
+    tls_cfg.ca_cert_len = (ca_cert_end - ca_cert_start);
+    tls_cfg.client_cert = (const char *)client_cert_start;
+    tls_cfg.client_cert_len = (client_cert_end - client_cert_start);
+    tls_cfg.client_key = (const char *)client_key_start;
+    tls_cfg.client_key_len = (client_key_end - client_key_start);
+    tls_cfg.default_port = 8883;
+    cfg.network.transport = tls_session_transport_create(tls_cfg);
+    if (cfg.network.transport == nullptr) {
+        ESP_LOGE(TAG, "Failed to create TLS session transport");
+        return;
+    }
+#else
     cfg.broker.verification.certificate = (const char *)ca_cert_start;
     cfg.broker.verification.certificate_len = (ca_cert_end - ca_cert_start);
     cfg.broker.verification.skip_cert_common_name_check = false;
@@ -248,8 +444,19 @@ void mqtt_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue) {
     cfg.credentials.authentication.certificate_len = (client_cert_end - client_cert_start);
     cfg.credentials.authentication.key = (const char *)client_key_start;
     cfg.credentials.authentication.key_len = (client_key_end - client_key_start);
+#endif
     cfg.credentials.client_id = s_ctx.client_id;
 
+    cfg.session.keepalive = CONFIG_MQTT_KEEPALIVE_S;
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    // client id is derived from the MAC, so the broker finds the same session after reconnects
+    cfg.session.disable_clean_session = true;
+#endif
+
+    // sized up front so the client never grows them, longer replies (cache warm-up) arrive in fragments
+    cfg.buffer.size = CONFIG_MQTT_BUFFER_SIZE;
+    cfg.buffer.out_size = CONFIG_MQTT_BUFFER_SIZE;
+
     cfg.network.reconnect_timeout_ms = 5000;
     cfg.network.timeout_ms = 10000;
     cfg.network.disable_auto_reconnect = false;
@@ -289,3 +496,23 @@ void mqtt_service_stop() {
         s_ctx.init_timer = nullptr;
     }
 }
+
+esp_err_t mqtt_service_publish_status(const char* report, const char* payload, size_t len) {
+    if (s_ctx.client == nullptr) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (len > mqtt_service_status_payload_max(strlen(report))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    char topic[sizeof(CONFIG_MQTT_TOPIC_STATUS) + sizeof(s_ctx.client_id) + 16];
+    const int written = snprintf(topic, sizeof(topic), "%s/%s/%s", CONFIG_MQTT_TOPIC_STATUS, s_ctx.client_id, report);
+    if (written <= 0 || written >= static_cast<int>(sizeof(topic))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // enqueue never blocks on the network, the MQTT task sends it
+    return (esp_mqtt_client_enqueue(s_ctx.client, topic, payload, static_cast<int>(len), 0, 0, true) >= 0)
+        ? ESP_OK
+        : ESP_FAIL;
+}
@@ -0,0 +1,121 @@
+#include "ota_resume_store.h"
+
+#include <cstring>
+#include "nvs.h"
+#include "esp_log.h"
+
+static const char* TAG = "ota_resume_store";
+static constexpr const char* NVS_NAMESPACE = "ota_resume";
+static constexpr const char* NVS_KEY_URL = "url";
+static constexpr const char* NVS_KEY_VALIDATOR = "validator";
+static constexpr const char* NVS_KEY_SIZE = "size";
+static constexpr const char* NVS_KEY_OFFSET = "offset";
+static constexpr const char* NVS_KEY_DIGEST = "digest";
+
+esp_err_t ota_resume_store_begin(const char* url, const char* validator, const uint32_t image_size)
+{
+    nvs_handle_t handle = 0;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_erase_all(handle);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, NVS_KEY_URL, url);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, NVS_KEY_VALIDATOR, validator);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_u32(handle, NVS_KEY_SIZE, image_size);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs write/commit failed: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t ota_resume_store_checkpoint(const uint32_t offset, const uint8_t digest[32])
+{
+    nvs_handle_t handle = 0;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    err = nvs_set_blob(handle, NVS_KEY_DIGEST, digest, 32);
+    if (err == ESP_OK) {
+        err = nvs_set_u32(handle, NVS_KEY_OFFSET, offset);
+    }
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Checkpoint at %lu failed: %s", (unsigned long)offset, esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t ota_resume_store_load(OtaResumeState* state_out)
+{
+    if (state_out == nullptr) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    nvs_handle_t handle = 0;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    OtaResumeState state{};
+    size_t url_len = sizeof(state.url);
+    size_t validator_len = sizeof(state.validator);
+    size_t digest_len = sizeof(state.digest);
+
+    err = nvs_get_str(handle, NVS_KEY_URL, state.url, &url_len);
+    if (err == ESP_OK) {
+        // records without one predate If-Range and cannot be resumed safely
+        err = nvs_get_str(handle, NVS_KEY_VALIDATOR, state.validator, &validator_len);
+    }
+    if (err == ESP_OK) {
+        err = nvs_get_u32(handle, NVS_KEY_SIZE, &state.image_size);
+    }
+    if (err == ESP_OK) {
+        // no checkpoint yet means nothing worth resuming
+        err = nvs_get_u32(handle, NVS_KEY_OFFSET, &state.offset);
+    }
+    if (err == ESP_OK) {
+        err = nvs_get_blob(handle, NVS_KEY_DIGEST, state.digest, &digest_len);
+    }
+
+    nvs_close(handle);
+
+    if (err == ESP_OK) {
+        *state_out = state;
+    }
+    return err;
+}
+
+void ota_resume_store_clear()
+{
+    nvs_handle_t handle = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+
+    nvs_erase_all(handle);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
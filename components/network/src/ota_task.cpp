@@ -2,10 +2,29 @@
 
 #include "sdkconfig.h"
 #include "esp_err.h"
-#include "esp_https_ota.h"
+#include "esp_http_client.h"
+#include "esp_ota_ops.h"
+#include "esp_app_desc.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "events.h"
+#include "power_manager.h"
+#include "delta_patch.h"
+#include "ota_resume_store.h"
+#include "mqtt_service.h"
+#include "task_plan.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "spi_flash_mmap.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cstring>
+#include <new>
+#include <strings.h>
 
 extern const uint8_t ca_cert_start[] asm("_binary_ca_crt_start");
 extern const uint8_t ca_cert_end[] asm("_binary_ca_crt_end");
@@ -16,15 +35,326 @@ extern const uint8_t client_key_end[] asm("_binary_client_key_end");
 
 static const char *TAG = "ota_task";
 
-[[noreturn]] void ota_task(void *pvParameters)
+// one buffer is filled from the network while the other is written to flash
+constexpr size_t OTA_BUFFER_COUNT = 2;
+constexpr size_t OTA_NET_BUFFER_SIZE = 1024;
+constexpr uint32_t OTA_CHECKPOINT_BYTES = CONFIG_OTA_CHECKPOINT_KB * 1024;
+constexpr uint32_t OTA_RETRY_BASE_MS = 2000;
+constexpr uint32_t OTA_RETRY_MAX_MS = 30000;
+
+// checkpoints land on chunk boundaries and a resumed sequential write has to start on a sector
+static_assert(CONFIG_OTA_CHUNK_SIZE % SPI_FLASH_SEC_SIZE == 0, "OTA_CHUNK_SIZE must be a multiple of the flash sector size");
+
+struct OtaChunk {
+    uint8_t *data;      // nullptr marks the end of the stream
+    size_t len;
+};
+
+struct OtaPipeline {
+    QueueHandle_t free_chunks;
+    QueueHandle_t full_chunks;
+    esp_ota_handle_t ota_handle;
+    TaskHandle_t reader;
+    std::atomic<esp_err_t> write_err;
+
+    // full images only: hash of what is on flash, checkpointed so a download can resume
+    bool checkpoints;
+    mbedtls_sha256_context sha;
+    uint32_t written;
+    uint32_t next_checkpoint;
+};
+
+// hands image bytes to the writer in chunk-sized pieces
+struct OtaSink {
+    OtaPipeline *pipeline;
+    OtaChunk chunk;
+};
+
+static esp_err_t sink_write(void *ctx, const uint8_t *data, size_t len)
 {
-    esp_log_level_set(TAG, ESP_LOG_DEBUG);
+    auto *sink = static_cast<OtaSink *>(ctx);
 
-    auto *params = static_cast<OtaTaskParams *>(pvParameters);
+    while (len > 0) {
+        if (sink->chunk.data == nullptr) {
+            xQueueReceive(sink->pipeline->free_chunks, &sink->chunk, portMAX_DELAY);
+            sink->chunk.len = 0;
+
+            const esp_err_t err = sink->pipeline->write_err.load();
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        const size_t n = std::min(len, CONFIG_OTA_CHUNK_SIZE - sink->chunk.len);
+        memcpy(sink->chunk.data + sink->chunk.len, data, n);
+        sink->chunk.len += n;
+        data += n;
+        len -= n;
+
+        if (sink->chunk.len == CONFIG_OTA_CHUNK_SIZE) {
+            xQueueSend(sink->pipeline->full_chunks, &sink->chunk, portMAX_DELAY);
+            sink->chunk.data = nullptr;
+        }
+    }
+    return ESP_OK;
+}
+
+static void sink_flush(OtaSink &sink)
+{
+    if (sink.chunk.data != nullptr && sink.chunk.len > 0) {
+        xQueueSend(sink.pipeline->full_chunks, &sink.chunk, portMAX_DELAY);
+    }
+    sink.chunk.data = nullptr;
+}
+
+// only at sector boundaries, a resumed sequential write erases the sector it starts in
+static void write_checkpoint(OtaPipeline *pipeline)
+{
+    if (pipeline->written < pipeline->next_checkpoint || (pipeline->written % SPI_FLASH_SEC_SIZE) != 0) {
+        return;
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_context snapshot;
+    mbedtls_sha256_init(&snapshot);
+    mbedtls_sha256_clone(&snapshot, &pipeline->sha);
+    mbedtls_sha256_finish(&snapshot, digest);
+    mbedtls_sha256_free(&snapshot);
+
+    ota_resume_store_checkpoint(pipeline->written, digest);
+    pipeline->next_checkpoint = pipeline->written + OTA_CHECKPOINT_BYTES;
+}
+
+static void ota_writer_task(void *pvParameters)
+{
+    auto *pipeline = static_cast<OtaPipeline *>(pvParameters);
+    OtaChunk chunk{};
+
+    for (;;) {
+        xQueueReceive(pipeline->full_chunks, &chunk, portMAX_DELAY);
+        if (chunk.data == nullptr) {
+            break;
+        }
+
+        if (pipeline->write_err.load() == ESP_OK) {
+            const esp_err_t err = esp_ota_write(pipeline->ota_handle, chunk.data, chunk.len);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
+                pipeline->write_err = err;
+            } else {
+                pipeline->written += chunk.len;
+                if (pipeline->checkpoints) {
+                    mbedtls_sha256_update(&pipeline->sha, chunk.data, chunk.len);
+                    write_checkpoint(pipeline);
+                }
+            }
+        }
+
+        xQueueSend(pipeline->free_chunks, &chunk, portMAX_DELAY);
+    }
+
+    xTaskNotifyGive(pipeline->reader);
+    vTaskDelete(nullptr);
+}
+
+// fills the whole buffer unless the body ends first, returns bytes read or -1
+static int read_chunk(esp_http_client_handle_t client, uint8_t *buffer, const size_t len)
+{
+    size_t filled = 0;
+    while (filled < len) {
+        const int n = esp_http_client_read(client, reinterpret_cast<char *>(buffer + filled), len - filled);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    return static_cast<int>(filled);
+}
+
+
+struct OtaDownload {
+    const char *url;
+    char validator[64];             // of the image being written, empty when the server sent none
+    char response_validator[64];    // of the current response
+    OtaPipeline *pipeline;
+    OtaSink sink;
+    DeltaPatch patch;
+    bool delta;
+    uint32_t received;      // body bytes consumed, image bytes for full images
+    uint32_t total;         // expected body size, 0 if unknown
+    int attempt;
+    int64_t attempt_start_us;
+    uint32_t attempt_start_bytes;
+    int last_percent;       // -1 until the first progress report
+};
+
+static void publish_progress(const OtaDownload &dl, const char *state)
+{
+    const int64_t elapsed_ms = (esp_timer_get_time() - dl.attempt_start_us) / 1000;
+    const uint32_t kbps = (elapsed_ms > 0)
+        ? static_cast<uint32_t>((dl.received - dl.attempt_start_bytes) * 8ULL / elapsed_ms)
+        : 0;
+
+    char payload[160];
+    const int len = snprintf(payload, sizeof(payload),
+                             "{\"state\":\"%s\",\"mode\":\"%s\",\"received\":%lu,\"total\":%lu,\"kbps\":%lu,\"attempt\":%d}",
+                             state, dl.delta ? "delta" : "full", (unsigned long)dl.received,
+                             (unsigned long)dl.total, (unsigned long)kbps, dl.attempt);
+    ESP_LOGI(TAG, "%s", payload);
+    mqtt_service_publish_status("ota", payload, len);
+}
+
+// rehashes what an earlier attempt left on flash and checks it against the checkpoint
+static bool rebuild_hash(const esp_partition_t *partition, const OtaResumeState &state,
+                         mbedtls_sha256_context &sha, uint8_t *scratch)
+{
+    for (uint32_t offset = 0; offset < state.offset; offset += CONFIG_OTA_CHUNK_SIZE) {
+        const size_t n = std::min<size_t>(CONFIG_OTA_CHUNK_SIZE, state.offset - offset);
+        if (esp_partition_read(partition, offset, scratch, n) != ESP_OK) {
+            return false;
+        }
+        mbedtls_sha256_update(&sha, scratch, n);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_context snapshot;
+    mbedtls_sha256_init(&snapshot);
+    mbedtls_sha256_clone(&snapshot, &sha);
+    mbedtls_sha256_finish(&snapshot, digest);
+    mbedtls_sha256_free(&snapshot);
+
+    return memcmp(digest, state.digest, sizeof(digest)) == 0;
+}
+
+// strong ETag preferred, Last-Modified otherwise, weak ETags are not allowed in If-Range
+static esp_err_t on_http_event(esp_http_client_event_t *evt)
+{
+    if (evt->event_id != HTTP_EVENT_ON_HEADER) {
+        return ESP_OK;
+    }
+
+    auto *dl = static_cast<OtaDownload *>(evt->user_data);
+    const bool etag = strcasecmp(evt->header_key, "ETag") == 0 && strncmp(evt->header_value, "W/", 2) != 0;
+    const bool last_modified = strcasecmp(evt->header_key, "Last-Modified") == 0;
+    if (etag || (last_modified && dl->response_validator[0] == '\0')) {
+        strlcpy(dl->response_validator, evt->header_value, sizeof(dl->response_validator));
+    }
+    return ESP_OK;
+}
+
+// one HTTP request, from dl.received to the end of the body
+static esp_err_t download_attempt(esp_http_client_handle_t client, OtaDownload &dl, uint8_t *net)
+{
+    char range[32];
+    if (dl.received > 0) {
+        // If-Range makes the server send the whole new image instead of splicing it onto ours
+        snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)dl.received);
+        esp_http_client_set_header(client, "Range", range);
+        esp_http_client_set_header(client, "If-Range", dl.validator);
+    } else {
+        esp_http_client_delete_header(client, "Range");
+        esp_http_client_delete_header(client, "If-Range");
+    }
+    dl.response_validator[0] = '\0';
+
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    const int content_length = esp_http_client_fetch_headers(client);
+    const int status = esp_http_client_get_status_code(client);
+    if (status != 200 && status != 206) {
+        ESP_LOGE(TAG, "Unexpected HTTP status %d", status);
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (status == 200 && dl.received > 0 && strcmp(dl.response_validator, dl.validator) != 0) {
+        // the checkpoint is dropped below, so the next FIRMWARE command downloads from byte 0
+        ESP_LOGE(TAG, "Image changed since the partial download (%s -> %s), abandoning it",
+                 dl.validator, dl.response_validator);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // a server that ignores Range resends the same image, drop what we already have
+    uint32_t discard = (status == 200) ? dl.received : 0;
+    if (status == 200 && content_length > 0) {
+        dl.total = content_length;
+    }
+
+    dl.attempt_start_us = esp_timer_get_time();
+    dl.attempt_start_bytes = dl.received;
+
+    while (true) {
+        const int n = read_chunk(client, net, OTA_NET_BUFFER_SIZE);
+        if (n < 0) {
+            ESP_LOGW(TAG, "Download interrupted at %lu bytes", (unsigned long)dl.received);
+            return ESP_FAIL;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        const uint8_t *data = net;
+        size_t len = n;
+        if (discard > 0) {
+            const size_t skip = std::min<size_t>(discard, len);
+            discard -= skip;
+            data += skip;
+            len -= skip;
+        }
 
+        if (len > 0) {
+            // the server answers with a patch when it has one for our base, a full image otherwise
+            if (dl.received == 0) {
+                dl.delta = DeltaPatch::is_patch(data, len);
+                strlcpy(dl.validator, dl.response_validator, sizeof(dl.validator));
+                if (dl.delta) {
+                    dl.patch.begin(esp_ota_get_running_partition(), &sink_write, &dl.sink);
+                } else if (dl.validator[0] == '\0') {
+                    ESP_LOGW(TAG, "No ETag or Last-Modified, download cannot be resumed");
+                } else if (ota_resume_store_begin(dl.url, dl.validator, dl.total) == ESP_OK) {
+                    dl.pipeline->checkpoints = true;
+                }
+            }
+
+            dl.received += len;
+            err = dl.delta ? dl.patch.feed(data, len) : sink_write(&dl.sink, data, len);
+            if (err != ESP_OK) {
+                return err;
+            }
+        }
+
+        if (dl.total > 0) {
+            const int percent = static_cast<int>(dl.received * 100ULL / dl.total);
+            if (dl.last_percent < 0 || percent / 10 != dl.last_percent / 10) {
+                dl.last_percent = percent;
+                publish_progress(dl, "downloading");
+            }
+        }
+
+        if (n < static_cast<int>(OTA_NET_BUFFER_SIZE)) {
+            break;
+        }
+    }
+
+    if (!esp_http_client_is_complete_data_received(client)) {
+        ESP_LOGW(TAG, "Body ended early at %lu bytes", (unsigned long)dl.received);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static esp_http_client_handle_t create_client(const char *url, OtaDownload *dl)
+{
     esp_http_client_config_t http_config{};
 
-    http_config.url = params->url;
+    http_config.url = url;
+    http_config.event_handler = &on_http_event;
+    http_config.user_data = dl;
 
     http_config.cert_pem = reinterpret_cast<const char *>(ca_cert_start);
     http_config.cert_len = ca_cert_end - ca_cert_start;
@@ -38,18 +368,190 @@ static const char *TAG = "ota_task";
     http_config.skip_cert_common_name_check = false;
     http_config.timeout_ms = 10000;
 
-    esp_https_ota_config_t ota_config{};
-    ota_config.http_config = &http_config;
+    esp_http_client_handle_t client = esp_http_client_init(&http_config);
+    if (client != nullptr) {
+        // lets the server pick a patch made against the running build
+        char base_sha[65];
+        esp_app_get_elf_sha256(base_sha, sizeof(base_sha));
+        esp_http_client_set_header(client, "X-Base-Elf-Sha256", base_sha);
+    }
+    return client;
+}
+
+static esp_err_t run_ota(const char *url)
+{
+    PowerLockGuard ota_lock(POWER_LOCK_OTA);
+
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(nullptr);
+    if (partition == nullptr) {
+        ESP_LOGE(TAG, "No OTA partition to update");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto *buffers = static_cast<uint8_t *>(
+        heap_caps_malloc(OTA_BUFFER_COUNT * CONFIG_OTA_CHUNK_SIZE + OTA_NET_BUFFER_SIZE, MALLOC_CAP_8BIT));
+    if (buffers == nullptr) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t *net = buffers + OTA_BUFFER_COUNT * CONFIG_OTA_CHUNK_SIZE;
+
+    // kept off the task stack, the TLS handshake needs it
+    auto *pipeline = new (std::nothrow) OtaPipeline{};
+    auto *dl = new (std::nothrow) OtaDownload{};
+    if (pipeline == nullptr || dl == nullptr) {
+        delete pipeline;
+        delete dl;
+        heap_caps_free(buffers);
+        return ESP_ERR_NO_MEM;
+    }
+
+    pipeline->reader = xTaskGetCurrentTaskHandle();
+    pipeline->write_err = ESP_OK;
+    mbedtls_sha256_init(&pipeline->sha);
+    mbedtls_sha256_starts(&pipeline->sha, 0);
+
+    dl->url = url;
+    dl->pipeline = pipeline;
+    dl->sink.pipeline = pipeline;
+    dl->last_percent = -1;
 
-    ESP_LOGI(TAG, "Starting HTTPS OTA from %s", http_config.url);
+    OtaResumeState resume{};
+    if (ota_resume_store_load(&resume) == ESP_OK && strcmp(resume.url, url) == 0 && resume.validator[0] != '\0') {
+        if (rebuild_hash(partition, resume, pipeline->sha, buffers)) {
+            ESP_LOGI(TAG, "Resuming download at %lu bytes (%s)", (unsigned long)resume.offset, resume.validator);
+            strlcpy(dl->validator, resume.validator, sizeof(dl->validator));
+            dl->received = resume.offset;
+            dl->total = resume.image_size;
+            pipeline->checkpoints = true;
+        } else {
+            ESP_LOGW(TAG, "Partial image does not match its checkpoint, starting over");
+            ota_resume_store_clear();
+            mbedtls_sha256_free(&pipeline->sha);
+            mbedtls_sha256_init(&pipeline->sha);
+            mbedtls_sha256_starts(&pipeline->sha, 0);
+        }
+    }
+
+    pipeline->written = dl->received;
+    pipeline->next_checkpoint = dl->received + OTA_CHECKPOINT_BYTES;
+    pipeline->free_chunks = xQueueCreate(OTA_BUFFER_COUNT, sizeof(OtaChunk));
+    pipeline->full_chunks = xQueueCreate(OTA_BUFFER_COUNT + 1, sizeof(OtaChunk));
 
-    const esp_err_t err = esp_https_ota(&ota_config);
+    esp_err_t err = (pipeline->free_chunks != nullptr && pipeline->full_chunks != nullptr) ? ESP_OK : ESP_ERR_NO_MEM;
 
     if (err == ESP_OK) {
-        ESP_LOGI(TAG, "OTA successful, restarting");
+        // erases sector by sector as data arrives instead of the whole slot up front
+        err = (dl->received > 0)
+            ? esp_ota_resume(partition, OTA_WITH_SEQUENTIAL_WRITES, dl->received, &pipeline->ota_handle)
+            : esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &pipeline->ota_handle);
+    }
+
+    esp_http_client_handle_t client = nullptr;
+    if (err == ESP_OK) {
+        client = create_client(url, dl);
+        if (client == nullptr) {
+            esp_ota_abort(pipeline->ota_handle);
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+
+    if (err == ESP_OK &&
+        xTaskCreatePinnedToCore(ota_writer_task, "ota_writer", 4096, pipeline, CONFIG_OTA_TASK_PRIORITY, nullptr, NETWORK_CORE) != pdPASS) {
+        esp_ota_abort(pipeline->ota_handle);
+        err = ESP_ERR_NO_MEM;
+    }
+
+    if (err != ESP_OK) {
+        if (client != nullptr) esp_http_client_cleanup(client);
+        if (pipeline->free_chunks != nullptr) vQueueDelete(pipeline->free_chunks);
+        if (pipeline->full_chunks != nullptr) vQueueDelete(pipeline->full_chunks);
+        mbedtls_sha256_free(&pipeline->sha);
+        delete dl;
+        delete pipeline;
+        heap_caps_free(buffers);
+        return err;
+    }
+
+    for (size_t i = 0; i < OTA_BUFFER_COUNT; ++i) {
+        const OtaChunk chunk{ buffers + i * CONFIG_OTA_CHUNK_SIZE, 0 };
+        xQueueSend(pipeline->free_chunks, &chunk, 0);
+    }
+
+    uint32_t retry_ms = OTA_RETRY_BASE_MS;
+    for (;;) {
+        err = download_attempt(client, *dl, net);
+        esp_http_client_close(client);
+
+        // only network failures on a full image are worth resuming, patches are small and stateful,
+        // and without a validator a range request could splice a different image onto ours
+        if (err != ESP_FAIL || dl->delta || dl->validator[0] == '\0' || dl->attempt >= CONFIG_OTA_MAX_RETRIES) {
+            break;
+        }
+
+        ++dl->attempt;
+        publish_progress(*dl, "retrying");
+        vTaskDelay(pdMS_TO_TICKS(retry_ms));
+        retry_ms = std::min(retry_ms * 2, OTA_RETRY_MAX_MS);
+    }
+
+    if (err == ESP_OK && dl->delta) {
+        err = dl->patch.finish();
+    }
+
+    sink_flush(dl->sink);
+    const OtaChunk end{ nullptr, 0 };
+    xQueueSend(pipeline->full_chunks, &end, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (err == ESP_OK) {
+        err = pipeline->write_err.load();
+    }
+
+    if (err == ESP_OK) {
+        err = esp_ota_end(pipeline->ota_handle);
     } else {
-        ESP_LOGE(TAG, "OTA failed (%s), restarting", esp_err_to_name(err));
+        esp_ota_abort(pipeline->ota_handle);
+    }
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(partition);
+    }
+
+    // a network failure keeps the checkpoint so the next attempt or reboot resumes,
+    // anything else means the partial image cannot be trusted
+    if (err != ESP_FAIL) {
+        ota_resume_store_clear();
+    }
+    publish_progress(*dl, (err == ESP_OK) ? "done" : "failed");
+
+    esp_http_client_cleanup(client);
+    vQueueDelete(pipeline->free_chunks);
+    vQueueDelete(pipeline->full_chunks);
+    mbedtls_sha256_free(&pipeline->sha);
+    delete dl;
+    delete pipeline;
+    heap_caps_free(buffers);
+    return err;
+}
+
+void ota_task(void *pvParameters)
+{
+    esp_log_level_set(TAG, ESP_LOG_DEBUG);
+
+    auto *params = static_cast<OtaTaskParams *>(pvParameters);
+
+    ESP_LOGI(TAG, "Starting background OTA from %s", params->url);
+
+    const esp_err_t err = run_ota(params->url);
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "OTA successful, restarting");
+        // give the final progress report a moment to leave
+        vTaskDelay(pdMS_TO_TICKS(500));
+        esp_restart();
     }
 
-    esp_restart();
-}
\ No newline at end of file
+    // the station never stopped serving, so a failed update just leaves it on the current image
+    ESP_LOGE(TAG, "OTA failed (%s), keeping current firmware", esp_err_to_name(err));
+    xEventGroupClearBits(params->eventGroup, BIT_OTA_RUNNING);
+    vTaskDelete(nullptr);
+}
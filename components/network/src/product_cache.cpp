@@ -0,0 +1,293 @@
+#include "product_cache.h"
+
+#if CONFIG_PRODUCT_CACHE
+
+#include <cstring>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rtc_time.h"
+#include "freertos/FreeRTOS.h"
+#include "json_parser.h"
+
+static const char *TAG = "product_cache";
+
+constexpr uint32_t POPULARITY_MAGIC = 0x504F5032; // "POP2"
+constexpr uint16_t SCAN_WEIGHT = 16;
+constexpr uint16_t SCORE_MAX = 0xFFFF;
+
+// decay is applied in eighths of a half-life, each step keeps 2^(-1/8) of a score (16.16 fixed point)
+constexpr uint32_t DECAY_STEPS_PER_HALF_LIFE = 8;
+constexpr uint64_t DECAY_STEP_US = CONFIG_PRODUCT_CACHE_HALF_LIFE_H * 3600ULL * 1000000ULL / DECAY_STEPS_PER_HALF_LIFE;
+constexpr uint32_t DECAY_STEP_FACTOR = 60097;
+
+struct PopularityEntry {
+    Barcode barcode;
+    uint16_t score;
+};
+
+// scan counts that halve every PRODUCT_CACHE_HALF_LIFE_H of RTC time, however often the station boots
+struct PopularityTable {
+    uint32_t magic;
+    uint64_t decayed_us;    // RTC time the scores were last decayed to, counts through deep sleep
+    PopularityEntry entries[CONFIG_PRODUCT_CACHE_TRACKED];
+};
+
+RTC_DATA_ATTR static PopularityTable s_popularity;
+
+struct CacheEntry {
+    Barcode barcode;
+    int64_t stored_us;
+    ProductData product;
+};
+
+static struct {
+    CacheEntry entries[CONFIG_PRODUCT_CACHE_SLOTS]{};
+    uint32_t next_victim{0};
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+} s_cache;
+
+static bool barcode_eq(const Barcode& stored, const char* barcode)
+{
+    return strncmp(stored, barcode, sizeof(Barcode)) == 0;
+}
+
+static void barcode_copy(Barcode& dst, const char* barcode)
+{
+    strncpy(dst, barcode, sizeof(Barcode) - 1);
+    dst[sizeof(Barcode) - 1] = '\0';
+}
+
+// caller holds s_cache.mux
+static CacheEntry* find_cached(const char* barcode)
+{
+    for (CacheEntry& entry : s_cache.entries) {
+        if (entry.barcode[0] != '\0' && barcode_eq(entry.barcode, barcode)) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+// caller holds s_cache.mux; only whole steps are applied, the remainder carries over
+static void decay_to(const uint64_t now_us)
+{
+    if (now_us <= s_popularity.decayed_us) {
+        return;
+    }
+
+    const uint64_t steps = (now_us - s_popularity.decayed_us) / DECAY_STEP_US;
+    if (steps == 0) {
+        return;
+    }
+    s_popularity.decayed_us += steps * DECAY_STEP_US;
+
+    uint32_t factor = 1 << 16;
+    for (uint64_t i = 0; i < steps && factor > 0; ++i) {
+        factor = (factor * DECAY_STEP_FACTOR) >> 16;
+    }
+
+    // rounded down, so the decay rounds up and one-off scans reach zero
+    for (PopularityEntry& entry : s_popularity.entries) {
+        entry.score = static_cast<uint16_t>((static_cast<uint32_t>(entry.score) * factor) >> 16);
+        if (entry.score == 0) {
+            entry.barcode[0] = '\0';
+        }
+    }
+}
+
+void product_cache_init()
+{
+    const uint64_t now_us = esp_rtc_get_time_us();
+
+    portENTER_CRITICAL(&s_cache.mux);
+    if (s_popularity.magic != POPULARITY_MAGIC || now_us < s_popularity.decayed_us) {
+        memset(&s_popularity, 0, sizeof(s_popularity));
+        s_popularity.magic = POPULARITY_MAGIC;
+        s_popularity.decayed_us = now_us;
+    } else {
+        decay_to(now_us);
+    }
+    portEXIT_CRITICAL(&s_cache.mux);
+}
+
+void product_cache_record_scan(const char* barcode)
+{
+    if (barcode[0] == '\0') {
+        return;
+    }
+
+    const uint64_t now_us = esp_rtc_get_time_us();
+    portENTER_CRITICAL(&s_cache.mux);
+    decay_to(now_us);
+    PopularityEntry* slot = nullptr;
+    for (PopularityEntry& entry : s_popularity.entries) {
+        if (entry.barcode[0] != '\0' && barcode_eq(entry.barcode, barcode)) {
+            slot = &entry;
+            break;
+        }
+        // an unknown barcode takes the least popular slot
+        if (slot == nullptr || entry.score < slot->score) {
+            slot = &entry;
+        }
+    }
+
+    if (!barcode_eq(slot->barcode, barcode)) {
+        barcode_copy(slot->barcode, barcode);
+        slot->score = 0;
+    }
+    slot->score = (slot->score > SCORE_MAX - SCAN_WEIGHT) ? SCORE_MAX : slot->score + SCAN_WEIGHT;
+    portEXIT_CRITICAL(&s_cache.mux);
+}
+
+bool product_cache_lookup(const char* barcode, ProductData& out)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_cache.mux);
+    const CacheEntry* entry = find_cached(barcode);
+    const bool fresh = entry != nullptr && now_us - entry->stored_us < CONFIG_PRODUCT_CACHE_TTL_S * 1000000LL;
+    if (fresh) {
+        out = entry->product;
+    }
+    portEXIT_CRITICAL(&s_cache.mux);
+    return fresh;
+}
+
+void product_cache_store(const char* barcode, const ProductData& product)
+{
+    portENTER_CRITICAL(&s_cache.mux);
+    CacheEntry* entry = find_cached(barcode);
+    if (entry == nullptr) {
+        // the batch arrives most popular first, round robin keeps the head of it
+        entry = &s_cache.entries[s_cache.next_victim];
+        s_cache.next_victim = (s_cache.next_victim + 1) % CONFIG_PRODUCT_CACHE_SLOTS;
+        barcode_copy(entry->barcode, barcode);
+    }
+    entry->product = product;
+    entry->stored_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&s_cache.mux);
+}
+
+size_t product_cache_top(Barcode* out, const size_t max)
+{
+    bool taken[CONFIG_PRODUCT_CACHE_TRACKED]{};
+    size_t count = 0;
+
+    const uint64_t now_us = esp_rtc_get_time_us();
+    portENTER_CRITICAL(&s_cache.mux);
+    decay_to(now_us);
+    while (count < max) {
+        int best = -1;
+        for (int i = 0; i < CONFIG_PRODUCT_CACHE_TRACKED; ++i) {
+            const PopularityEntry& entry = s_popularity.entries[i];
+            if (taken[i] || entry.barcode[0] == '\0' || entry.score == 0) {
+                continue;
+            }
+            if (best < 0 || entry.score > s_popularity.entries[best].score) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        taken[best] = true;
+        if (find_cached(s_popularity.entries[best].barcode) == nullptr) {
+            barcode_copy(out[count++], s_popularity.entries[best].barcode);
+        }
+    }
+    portEXIT_CRITICAL(&s_cache.mux);
+    return count;
+}
+
+void ProductBatchParser::begin(const EntryFn entry)
+{
+    entry_ = entry;
+    len_ = 0;
+    depth_ = 0;
+    started_ = false;
+    in_string_ = false;
+    escape_ = false;
+    overflow_ = false;
+    entries_ = 0;
+}
+
+void ProductBatchParser::finish_entry()
+{
+    if (overflow_) {
+        // one oversized object is skipped, the rest of the batch still counts
+        ESP_LOGW(TAG, "Batch entry over %u bytes skipped", (unsigned)ENTRY_BUFFER_SIZE);
+        overflow_ = false;
+        len_ = 0;
+        return;
+    }
+
+    Barcode barcode{};
+    ProductData product{};
+    const bool parsed = parse_product_entry_json(buf_, len_, barcode, sizeof(barcode), &product);
+    len_ = 0;
+    if (!parsed || barcode[0] == '\0') {
+        ESP_LOGW(TAG, "Batch entry without barcode skipped");
+        return;
+    }
+
+    ++entries_;
+    entry_(barcode, product);
+}
+
+bool ProductBatchParser::feed(const char* data, const size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        const char c = data[i];
+
+        if (depth_ >= 2) {
+            if (len_ < sizeof(buf_)) {
+                buf_[len_++] = c;
+            } else {
+                overflow_ = true;
+            }
+
+            if (in_string_) {
+                if (escape_) {
+                    escape_ = false;
+                } else if (c == '\\') {
+                    escape_ = true;
+                } else if (c == '"') {
+                    in_string_ = false;
+                }
+            } else if (c == '"') {
+                in_string_ = true;
+            } else if (c == '{' || c == '[') {
+                ++depth_;
+            } else if (c == '}' || c == ']') {
+                if (--depth_ == 1) {
+                    finish_entry();
+                }
+            }
+            continue;
+        }
+
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            continue;
+        }
+
+        if (depth_ == 0) {
+            if (started_ || c != '[') {
+                return false;
+            }
+            started_ = true;
+            depth_ = 1;
+        } else if (c == '{') {
+            buf_[0] = c;
+            len_ = 1;
+            depth_ = 2;
+        } else if (c == ']') {
+            depth_ = 0;
+        } else if (c != ',') {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,311 @@
+#include "tls_session_transport.h"
+#include <cstdlib>
+#include <cstring>
+#include <sys/select.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "esp_idf_version.h"
+#include "mbedtls/ssl.h"
+#include "boot_timeline.h"
+
+static struct {
+    int64_t last_handshake_us{-1};
+    bool last_offered_ticket{false};
+} s_stats;
+
+#if CONFIG_MQTT_TLS_SESSION_RESUMPTION
+
+static const char *TAG = "tls_session";
+
+// Restoring needs an esp_tls_client_session_t and esp_tls has no public constructor for one.
+// The type stays opaque here; a bare mbedtls_ssl_session is handed over in its place, which
+// relies on the private layout in esp_tls_private.h (a struct holding only that session).
+// Nothing checks that layout at build time: the version gate below lists the IDF releases it was
+// read from, and a newer IDF has to be checked by hand before the range is widened.
+// Saving goes through the public esp_tls_get_ssl_context() + mbedtls_ssl_get_session().
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0) || ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 6, 0)
+#error "esp_tls_client_session layout not verified for this IDF, check esp_tls_private.h"
+#endif
+
+constexpr uint32_t TLS_TICKET_MAGIC = 0x544B5431; // "TKT1"
+
+// serialized mbedtls session (ticket + resumption secret), survives deep sleep
+struct TlsTicketCache {
+    uint32_t magic;
+    uint16_t len;
+    uint8_t data[CONFIG_MQTT_TLS_TICKET_CACHE_SIZE];
+};
+
+RTC_DATA_ATTR static TlsTicketCache s_ticket;
+
+struct TransportCtx {
+    esp_tls_t* tls;
+    esp_tls_cfg_t cfg;
+    bool ticket_captured;
+};
+
+static esp_tls_client_session_t* load_ticket()
+{
+    if (s_ticket.magic != TLS_TICKET_MAGIC || s_ticket.len == 0) {
+        return nullptr;
+    }
+
+    // freed by esp_tls_free_client_session(), i.e. mbedtls_ssl_session_free() + free()
+    auto* session = static_cast<mbedtls_ssl_session*>(calloc(1, sizeof(mbedtls_ssl_session)));
+    if (session == nullptr) {
+        return nullptr;
+    }
+
+    mbedtls_ssl_session_init(session);
+    const int ret = mbedtls_ssl_session_load(session, s_ticket.data, s_ticket.len);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Cached ticket unusable (-0x%x), dropping it", -ret);
+        mbedtls_ssl_session_free(session);
+        free(session);
+        tls_session_transport_forget();
+        return nullptr;
+    }
+
+    return reinterpret_cast<esp_tls_client_session_t*>(session);
+}
+
+// TLS 1.3 tickets arrive after the handshake, so this is retried on reads until one shows up
+static void try_capture_ticket(TransportCtx* ctx)
+{
+    auto* ssl = static_cast<mbedtls_ssl_context*>(esp_tls_get_ssl_context(ctx->tls));
+    if (ssl == nullptr) {
+        return;
+    }
+
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    if (mbedtls_ssl_get_session(ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+
+    // mbedtls 3.x has no getter, the field itself is stable across its releases
+    if (session.MBEDTLS_PRIVATE(ticket_len) == 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+
+    size_t olen = 0;
+    const int ret = mbedtls_ssl_session_save(&session, s_ticket.data, sizeof(s_ticket.data), &olen);
+    mbedtls_ssl_session_free(&session);
+    ctx->ticket_captured = true;
+
+    if (ret != 0) {
+        ESP_LOGW(TAG, "Ticket does not fit the RTC cache (-0x%x), raise MQTT_TLS_TICKET_CACHE_SIZE", -ret);
+        tls_session_transport_forget();
+        return;
+    }
+
+    s_ticket.len = static_cast<uint16_t>(olen);
+    s_ticket.magic = TLS_TICKET_MAGIC;
+    ESP_LOGD(TAG, "Session ticket cached (%u bytes)", (unsigned)olen);
+}
+
+static int tls_poll(esp_transport_handle_t t, int timeout_ms, bool for_read)
+{
+    auto* ctx = static_cast<TransportCtx*>(esp_transport_get_context_data(t));
+    if (ctx->tls == nullptr) {
+        return -1;
+    }
+
+    if (for_read && esp_tls_get_bytes_avail(ctx->tls) > 0) {
+        return 1;
+    }
+
+    int sockfd = -1;
+    if (esp_tls_get_conn_sockfd(ctx->tls, &sockfd) != ESP_OK || sockfd < 0) {
+        return -1;
+    }
+
+    fd_set fds;
+    fd_set errfds;
+    FD_ZERO(&fds);
+    FD_ZERO(&errfds);
+    FD_SET(sockfd, &fds);
+    FD_SET(sockfd, &errfds);
+
+    timeval tv{};
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    const int ret = for_read
+        ? select(sockfd + 1, &fds, nullptr, &errfds, timeout_ms < 0 ? nullptr : &tv)
+        : select(sockfd + 1, nullptr, &fds, &errfds, timeout_ms < 0 ? nullptr : &tv);
+
+    if (ret > 0 && FD_ISSET(sockfd, &errfds)) {
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    return tls_poll(t, timeout_ms, true);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return tls_poll(t, timeout_ms, false);
+}
+
+static int tls_close(esp_transport_handle_t t)
+{
+    auto* ctx = static_cast<TransportCtx*>(esp_transport_get_context_data(t));
+    if (ctx->tls != nullptr) {
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = nullptr;
+    }
+    return 0;
+}
+
+static int tls_connect(esp_transport_handle_t t, const char* host, int port, int timeout_ms)
+{
+    auto* ctx = static_cast<TransportCtx*>(esp_transport_get_context_data(t));
+    tls_close(t);
+
+    ctx->tls = esp_tls_init();
+    if (ctx->tls == nullptr) {
+        return -1;
+    }
+
+    ctx->cfg.timeout_ms = timeout_ms;
+    ctx->cfg.client_session = load_ticket();
+    ctx->ticket_captured = false;
+    s_stats.last_offered_ticket = ctx->cfg.client_session != nullptr;
+
+    const int64_t start_us = esp_timer_get_time();
+    const int ret = esp_tls_conn_new_sync(host, strlen(host), port, &ctx->cfg, ctx->tls);
+
+    if (ctx->cfg.client_session != nullptr) {
+        esp_tls_free_client_session(ctx->cfg.client_session);
+        ctx->cfg.client_session = nullptr;
+    }
+
+    if (ret <= 0) {
+        ESP_LOGE(TAG, "Handshake with %s:%d failed", host, port);
+        if (s_stats.last_offered_ticket) {
+            // a rejected ticket falls back to a full handshake on its own, only a failed one is dropped
+            tls_session_transport_forget();
+        }
+        tls_close(t);
+        return -1;
+    }
+
+    s_stats.last_handshake_us = esp_timer_get_time() - start_us;
+    boot_timeline_mark(BOOT_STAGE_TLS);
+    ESP_LOGI(TAG, "TLS handshake: %lld ms (%s)", s_stats.last_handshake_us / 1000,
+             s_stats.last_offered_ticket ? "ticket offered" : "full");
+    return 0;
+}
+
+static int tls_read(esp_transport_handle_t t, char* buffer, int len, int timeout_ms)
+{
+    auto* ctx = static_cast<TransportCtx*>(esp_transport_get_context_data(t));
+    if (ctx->tls == nullptr) {
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    if (esp_tls_get_bytes_avail(ctx->tls) <= 0) {
+        const int poll = tls_poll_read(t, timeout_ms);
+        if (poll < 0) {
+            return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+        }
+        if (poll == 0) {
+            return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+        }
+    }
+
+    const ssize_t ret = esp_tls_conn_read(ctx->tls, buffer, len);
+
+    // esp_tls reports a received NewSessionTicket as WANT_READ
+    if (!ctx->ticket_captured && (ret > 0 || ret == ESP_TLS_ERR_SSL_WANT_READ)) {
+        try_capture_ticket(ctx);
+    }
+
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return static_cast<int>(ret);
+}
+
+static int tls_write(esp_transport_handle_t t, const char* buffer, int len, int timeout_ms)
+{
+    auto* ctx = static_cast<TransportCtx*>(esp_transport_get_context_data(t));
+    if (ctx->tls == nullptr) {
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    const int poll = tls_poll_write(t, timeout_ms);
+    if (poll <= 0) {
+        return poll == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    const ssize_t ret = esp_tls_conn_write(ctx->tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_WRITE || ret == ESP_TLS_ERR_SSL_WANT_READ) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    return ret < 0 ? ERR_TCP_TRANSPORT_CONNECTION_FAILED : static_cast<int>(ret);
+}
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+    tls_close(t);
+    free(esp_transport_get_context_data(t));
+    esp_transport_set_context_data(t, nullptr);
+    return 0;
+}
+
+esp_transport_handle_t tls_session_transport_create(const TlsSessionTransportConfig& config)
+{
+    auto* ctx = static_cast<TransportCtx*>(calloc(1, sizeof(TransportCtx)));
+    if (ctx == nullptr) {
+        return nullptr;
+    }
+
+    ctx->cfg.cacert_buf = reinterpret_cast<const unsigned char*>(config.ca_cert);
+    ctx->cfg.cacert_bytes = config.ca_cert_len;
+    ctx->cfg.clientcert_buf = reinterpret_cast<const unsigned char*>(config.client_cert);
+    ctx->cfg.clientcert_bytes = config.client_cert_len;
+    ctx->cfg.clientkey_buf = reinterpret_cast<const unsigned char*>(config.client_key);
+    ctx->cfg.clientkey_bytes = config.client_key_len;
+
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == nullptr) {
+        free(ctx);
+        return nullptr;
+    }
+
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_default_port(t, config.default_port);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+    return t;
+}
+
+void tls_session_transport_forget()
+{
+    s_ticket.magic = 0;
+    s_ticket.len = 0;
+}
+
+#endif
+
+int64_t tls_session_last_handshake_us()
+{
+    return s_stats.last_handshake_us;
+}
+
+bool tls_session_last_offered_ticket()
+{
+    return s_stats.last_offered_ticket;
+}
@@ -5,29 +5,49 @@
 #include "esp_netif.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
-#include "print_message.h"
+#include "print_channel.h"
 #include "events.h"
+#include "boot_timeline.h"
 
 static const char *TAG = "wifi_service";
 
 constexpr int WIFI_MAX_FAILURES = 3;
+constexpr uint32_t WIFI_RECONNECT_BACKOFF_MIN_MS = 250;
+constexpr uint32_t WIFI_RTC_CACHE_MAGIC = 0x57494649; // "WIFI"
+
+// last association and lease, survives deep sleep so the next wake can skip the scan (and DHCP)
+struct WifiRtcCache {
+    uint32_t magic;
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip_info;
+    esp_ip4_addr_t dns;
+};
+
+RTC_DATA_ATTR static WifiRtcCache s_rtc_cache;
 
 static struct {
-    QueueHandle_t print_queue{};
+    PrintChannel* print{};
     QueueHandle_t control_queue{};
+    esp_netif_t* netif{};
+    esp_timer_handle_t reconnect_timer{};
     int disconnect_count{0};
     bool unreachable_notified{false};
+    bool fast_join{false};
+    bool bssid_pinned{false};
+    bool static_ip_applied{false};
+    uint32_t backoff_ms{WIFI_RECONNECT_BACKOFF_MIN_MS};
+    int64_t connect_started_us{0};
+    int64_t time_to_ip_us{-1};
 } s_ctx;
 
 static void send_wifi_status(bool connected, uint8_t last_octet = 0)
 {
-    PrintMessage msg{};
-    msg.type = WIFI_STATUS;
-    msg.data.wifi.connected = connected;
-    msg.data.wifi.ipLastOctet = last_octet;
-
-    xQueueSend(s_ctx.print_queue, &msg, 0);
+    s_ctx.print->post_wifi(connected, last_octet);
 }
 
 static void publish_control(ControlType type) {
@@ -35,19 +55,128 @@ static void publish_control(ControlType type) {
     ControlMessage msg{};
     msg.type = type;
     msg.payload[0] = '\0';
-    xQueueSend(s_ctx.control_queue, &msg, 0);
+    if (xQueueSend(s_ctx.control_queue, &msg, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Control queue full, control type %d dropped", static_cast<int>(type));
+    }
+}
+
+static void reconnect_timer_cb(void*)
+{
+    esp_wifi_connect();
+}
+
+static void schedule_reconnect()
+{
+    const esp_err_t err = esp_timer_start_once(s_ctx.reconnect_timer, s_ctx.backoff_ms * 1000ULL);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to schedule reconnect (%s), reconnecting now", esp_err_to_name(err));
+        esp_wifi_connect();
+        return;
+    }
+
+    ESP_LOGD(TAG, "Reconnecting in %lu ms", (unsigned long)s_ctx.backoff_ms);
+    s_ctx.backoff_ms = (s_ctx.backoff_ms * 2 > CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS)
+        ? CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS
+        : s_ctx.backoff_ms * 2;
+}
+
+// back to a normal scan and DHCP for the next connect, the cache itself is kept
+static void unpin_cached_join()
+{
+    s_ctx.bssid_pinned = false;
+
+    wifi_config_t sta_cfg{};
+    esp_wifi_get_config(WIFI_IF_STA, &sta_cfg);
+    sta_cfg.sta.bssid_set = false;
+    sta_cfg.sta.channel = 0;
+    sta_cfg.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &sta_cfg);
+
+    if (s_ctx.static_ip_applied) {
+        esp_netif_dhcpc_start(s_ctx.netif);
+        s_ctx.static_ip_applied = false;
+    }
+}
+
+static void fall_back_to_full_scan()
+{
+    ESP_LOGW(TAG, "Fast rejoin failed, falling back to full scan and DHCP");
+    s_ctx.fast_join = false;
+    s_rtc_cache.magic = 0;
+    unpin_cached_join();
+}
+
+static void apply_cached_ip()
+{
+#if CONFIG_WIFI_STATIC_IP_REUSE
+    if (esp_netif_dhcpc_stop(s_ctx.netif) != ESP_OK) {
+        return;
+    }
+
+    // posts IP_EVENT_STA_GOT_IP right away, no DHCP round trip
+    esp_netif_set_ip_info(s_ctx.netif, &s_rtc_cache.ip_info);
+
+    esp_netif_dns_info_t dns{};
+    dns.ip.type = ESP_IPADDR_TYPE_V4;
+    dns.ip.u_addr.ip4 = s_rtc_cache.dns;
+    esp_netif_set_dns_info(s_ctx.netif, ESP_NETIF_DNS_MAIN, &dns);
+
+    s_ctx.static_ip_applied = true;
+#endif
+}
+
+static void store_rtc_cache(const esp_netif_ip_info_t& ip_info)
+{
+    wifi_ap_record_t ap{};
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+
+    std::memcpy(s_rtc_cache.bssid, ap.bssid, sizeof(s_rtc_cache.bssid));
+    s_rtc_cache.channel = ap.primary;
+    s_rtc_cache.ip_info = ip_info;
+
+    esp_netif_dns_info_t dns{};
+    if (esp_netif_get_dns_info(s_ctx.netif, ESP_NETIF_DNS_MAIN, &dns) == ESP_OK) {
+        s_rtc_cache.dns = dns.ip.u_addr.ip4;
+    }
+    s_rtc_cache.magic = WIFI_RTC_CACHE_MAGIC;
 }
 
 static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
     if (event_base == WIFI_EVENT) {
         if (event_id == WIFI_EVENT_STA_START) {
+            s_ctx.connect_started_us = esp_timer_get_time();
             esp_wifi_connect();
         }
 
+        else if (event_id == WIFI_EVENT_STA_CONNECTED) {
+            if (s_ctx.fast_join) {
+                apply_cached_ip();
+            }
+        }
+
         else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
             send_wifi_status(false);
 
+            if (s_ctx.time_to_ip_us >= 0) {
+                // measure the next time-to-IP from the moment the link dropped
+                s_ctx.connect_started_us = esp_timer_get_time();
+                s_ctx.time_to_ip_us = -1;
+            }
+
+            if (s_ctx.fast_join) {
+                fall_back_to_full_scan();
+                esp_wifi_connect();
+                return;
+            }
+
+            // a link that dropped later in the session may mean the AP is gone, do not insist on it
+            if (s_ctx.bssid_pinned) {
+                unpin_cached_join();
+            }
+
             s_ctx.disconnect_count++;
             if (s_ctx.disconnect_count >= WIFI_MAX_FAILURES && !s_ctx.unreachable_notified) {
                 ESP_LOGW(TAG, "WiFi failed %d times, publishing MQTT_UNREACHABLE", s_ctx.disconnect_count);
@@ -55,34 +184,58 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base, int32_t e
                 s_ctx.unreachable_notified = true;
             }
 
-            esp_wifi_connect();
+            schedule_reconnect();
         }
     }
+    else if (event_base == APP_EVENT && event_id == APP_EVENT_STATION_IDLE) {
+        // max modem sleep honours listen_interval, lets the radio doze while light sleeping
+        esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    }
+    else if (event_base == APP_EVENT && event_id == APP_EVENT_STATION_ACTIVE) {
+        esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    }
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         const auto *ev = static_cast<const ip_event_got_ip_t *>(event_data);
         const uint8_t last_octet = esp_ip4_addr4(&ev->ip_info.ip);
         send_wifi_status(true, last_octet);
 
+        s_ctx.time_to_ip_us = esp_timer_get_time() - s_ctx.connect_started_us;
+        ESP_LOGI(TAG, "Time to IP: %lld ms (%s)", s_ctx.time_to_ip_us / 1000,
+                 s_ctx.static_ip_applied ? "cached BSSID + IP" : (s_ctx.fast_join ? "cached BSSID" : "full scan"));
+        store_rtc_cache(ev->ip_info);
+        boot_timeline_mark(BOOT_STAGE_IP);
+
+        // the fast join did its job, later disconnects back off like any other
+        s_ctx.fast_join = false;
+
+        s_ctx.backoff_ms = WIFI_RECONNECT_BACKOFF_MIN_MS;
         s_ctx.disconnect_count = 0;
         s_ctx.unreachable_notified = false;
         publish_control(ControlType::WIFI_CONNECTED);
     }
 }
 
-void wifi_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue)
+void wifi_service_init(PrintChannel& print, QueueHandle_t controlQueue)
 {
     esp_log_level_set(TAG, ESP_LOG_DEBUG);
 
-    s_ctx.print_queue = printQueue;
+    s_ctx.print = &print;
     s_ctx.control_queue = controlQueue;
 
-    esp_netif_create_default_wifi_sta();
+    s_ctx.netif = esp_netif_create_default_wifi_sta();
+
+    esp_timer_create_args_t timer_args{};
+    timer_args.callback = &reconnect_timer_cb;
+    timer_args.name = "wifi_reconnect";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_ctx.reconnect_timer));
 
     wifi_init_config_t init_cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&init_cfg));
 
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, nullptr, nullptr));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, nullptr, nullptr));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(APP_EVENT, APP_EVENT_STATION_IDLE, &wifi_event_handler, nullptr, nullptr));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(APP_EVENT, APP_EVENT_STATION_ACTIVE, &wifi_event_handler, nullptr, nullptr));
 
     wifi_config_t sta_cfg{};
     std::strncpy(reinterpret_cast<char *>(sta_cfg.sta.ssid), CONFIG_WIFI_SSID, sizeof(sta_cfg.sta.ssid) - 1);
@@ -91,8 +244,27 @@ void wifi_service_init(QueueHandle_t printQueue, QueueHandle_t controlQueue)
     sta_cfg.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
     sta_cfg.sta.pmf_cfg.capable = true;
     sta_cfg.sta.pmf_cfg.required = false;
+    sta_cfg.sta.listen_interval = CONFIG_WIFI_IDLE_LISTEN_INTERVAL;
+
+    if (s_rtc_cache.magic == WIFI_RTC_CACHE_MAGIC && esp_reset_reason() == ESP_RST_DEEPSLEEP) {
+        // rejoin the last AP on its channel without scanning
+        sta_cfg.sta.bssid_set = true;
+        std::memcpy(sta_cfg.sta.bssid, s_rtc_cache.bssid, sizeof(sta_cfg.sta.bssid));
+        sta_cfg.sta.channel = s_rtc_cache.channel;
+        sta_cfg.sta.scan_method = WIFI_FAST_SCAN;
+        s_ctx.fast_join = true;
+        s_ctx.bssid_pinned = true;
+        ESP_LOGD(TAG, "Fast rejoin on channel %u", s_rtc_cache.channel);
+    } else {
+        s_rtc_cache.magic = 0;
+    }
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_cfg));
     ESP_ERROR_CHECK(esp_wifi_start());
 }
+
+int64_t wifi_service_time_to_ip_us()
+{
+    return s_ctx.time_to_ip_us;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include "esp_err.h"
+
+enum PowerLockId : uint8_t {
+    POWER_LOCK_SCANNER,     // UART framing of scanner input
+    POWER_LOCK_MQTT,        // MQTT event handling and publishing
+    POWER_LOCK_RENDER,      // LVGL rendering
+    POWER_LOCK_FLUSH,       // SPI flush of rendered bands
+    POWER_LOCK_ACTIVE,      // station serving customers, blocks automatic light sleep
+    POWER_LOCK_OTA,         // background firmware download and flash writes
+    POWER_LOCK_COUNT,
+};
+
+struct PowerLockStats {
+    uint32_t acquisitions;
+    uint64_t held_us;
+    uint32_t max_held_us;
+};
+
+esp_err_t power_manager_init();
+
+void power_lock_acquire(PowerLockId id);
+void power_lock_release(PowerLockId id);
+
+PowerLockStats power_lock_stats(PowerLockId id);
+const char* power_lock_name(PowerLockId id);
+void power_manager_log_stats();
+
+class PowerLockGuard {
+public:
+    explicit PowerLockGuard(const PowerLockId id) : id_(id) { power_lock_acquire(id_); }
+    ~PowerLockGuard() { power_lock_release(id_); }
+
+    PowerLockGuard(const PowerLockGuard&) = delete;
+    PowerLockGuard& operator=(const PowerLockGuard&) = delete;
+
+private:
+    PowerLockId id_;
+};
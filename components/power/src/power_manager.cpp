@@ -0,0 +1,144 @@
+#include "power_manager.h"
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char* TAG = "power_manager";
+
+struct PowerLock {
+    const char* name;
+    esp_pm_lock_type_t type;
+    esp_pm_lock_handle_t handle;
+    uint32_t depth;
+    int64_t acquired_us;
+    PowerLockStats stats;
+};
+
+static PowerLock s_locks[POWER_LOCK_COUNT] = {
+    { "scanner", ESP_PM_CPU_FREQ_MAX, nullptr, 0, 0, {} },
+    { "mqtt",    ESP_PM_CPU_FREQ_MAX, nullptr, 0, 0, {} },
+    { "render",  ESP_PM_CPU_FREQ_MAX, nullptr, 0, 0, {} },
+    { "flush",   ESP_PM_APB_FREQ_MAX, nullptr, 0, 0, {} },
+    { "active",  ESP_PM_NO_LIGHT_SLEEP, nullptr, 0, 0, {} },
+    { "ota",     ESP_PM_CPU_FREQ_MAX, nullptr, 0, 0, {} },
+};
+
+static portMUX_TYPE s_lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+esp_err_t power_manager_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_DEBUG);
+
+#if CONFIG_PM_ENABLE
+    static_assert(CONFIG_POWER_MIN_CPU_FREQ_MHZ <= CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                  "POWER_MIN_CPU_FREQ above the default CPU frequency");
+    esp_pm_config_t pm_cfg{};
+    pm_cfg.max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    pm_cfg.min_freq_mhz = CONFIG_POWER_MIN_CPU_FREQ_MHZ;
+#if CONFIG_POWER_AUTO_LIGHT_SLEEP
+    pm_cfg.light_sleep_enable = true;
+#else
+    pm_cfg.light_sleep_enable = false;
+#endif
+
+    esp_err_t err = esp_pm_configure(&pm_cfg);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_pm_configure failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    for (PowerLock& lock : s_locks) {
+        err = esp_pm_lock_create(lock.type, 0, lock.name, &lock.handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create %s lock: %s", lock.name, esp_err_to_name(err));
+            return err;
+        }
+    }
+
+    // the station starts out active, the scanner releases this once it has been idle
+    power_lock_acquire(POWER_LOCK_ACTIVE);
+
+    ESP_LOGI(TAG, "DFS %d-%d MHz, light sleep %s", CONFIG_POWER_MIN_CPU_FREQ_MHZ,
+             CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, pm_cfg.light_sleep_enable ? "on" : "off");
+#else
+    ESP_LOGW(TAG, "CONFIG_PM_ENABLE is off, running at fixed clock");
+#endif
+
+    return ESP_OK;
+}
+
+void power_lock_acquire(const PowerLockId id)
+{
+    if (id >= POWER_LOCK_COUNT) {
+        return;
+    }
+    PowerLock& lock = s_locks[id];
+
+    if (lock.handle != nullptr) {
+        esp_pm_lock_acquire(lock.handle);
+    }
+
+    portENTER_CRITICAL_SAFE(&s_lock_mux);
+    if (lock.depth++ == 0) {
+        lock.acquired_us = esp_timer_get_time();
+        lock.stats.acquisitions++;
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock_mux);
+}
+
+void power_lock_release(const PowerLockId id)
+{
+    if (id >= POWER_LOCK_COUNT) {
+        return;
+    }
+    PowerLock& lock = s_locks[id];
+
+    portENTER_CRITICAL_SAFE(&s_lock_mux);
+    if (lock.depth > 0 && --lock.depth == 0) {
+        const auto held_us = static_cast<uint32_t>(esp_timer_get_time() - lock.acquired_us);
+        lock.stats.held_us += held_us;
+        if (held_us > lock.stats.max_held_us) {
+            lock.stats.max_held_us = held_us;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&s_lock_mux);
+
+    if (lock.handle != nullptr) {
+        esp_pm_lock_release(lock.handle);
+    }
+}
+
+PowerLockStats power_lock_stats(const PowerLockId id)
+{
+    if (id >= POWER_LOCK_COUNT) {
+        return {};
+    }
+
+    portENTER_CRITICAL_SAFE(&s_lock_mux);
+    const PowerLockStats stats = s_locks[id].stats;
+    portEXIT_CRITICAL_SAFE(&s_lock_mux);
+    return stats;
+}
+
+const char* power_lock_name(const PowerLockId id)
+{
+    return (id < POWER_LOCK_COUNT) ? s_locks[id].name : "unknown";
+}
+
+void power_manager_log_stats()
+{
+    const int64_t uptime_us = esp_timer_get_time();
+
+    for (int id = 0; id < POWER_LOCK_COUNT; ++id) {
+        const PowerLockStats stats = power_lock_stats(static_cast<PowerLockId>(id));
+        ESP_LOGI(TAG, "%-8s held %llu ms (%.2f%% of uptime) over %lu acquisitions, max %lu us",
+                 s_locks[id].name,
+                 (unsigned long long)(stats.held_us / 1000),
+                 uptime_us > 0 ? 100.0 * static_cast<double>(stats.held_us) / static_cast<double>(uptime_us) : 0.0,
+                 (unsigned long)stats.acquisitions,
+                 (unsigned long)stats.max_held_us);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+
+enum BootStage : uint8_t {
+    BOOT_STAGE_IP,              // DHCP lease (or cached IP) applied
+    BOOT_STAGE_TLS,             // broker TLS handshake done
+    BOOT_STAGE_SUBSCRIBED,      // control and product topics subscribed
+    BOOT_STAGE_FIRST_FRAME,     // first frame on the panel
+    BOOT_STAGE_SCANNER_READY,   // scanner woken and listening
+    BOOT_STAGE_COUNT,
+};
+
+// records the first time a stage is reached (later calls are ignored),
+// logs the whole timeline once every stage has been reached
+void boot_timeline_mark(BootStage stage);
+
+// time since reset the stage was reached at, -1 if not reached yet
+int64_t boot_timeline_stage_us(BootStage stage);
+
+void boot_timeline_log();
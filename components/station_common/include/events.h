@@ -6,22 +6,41 @@
 
 // main -> tasks
 constexpr EventBits_t BIT_REQ_STOP = (1 << 0);
+// a WAKE that cancels a SLEEP, stopped tasks block on it instead of suspending
+constexpr EventBits_t BIT_REQ_RESUME = (1 << 1);
 constexpr EventBits_t BIT_REQ_BARCODE_SCANNER_CONF = (1 << 2);
 
 // tasks -> main
 constexpr EventBits_t BIT_ACK_DISPLAY = (1 << 3);
 constexpr EventBits_t BIT_ACK_BARCODE = (1 << 4);
 
+// set while a background firmware download is in progress
+constexpr EventBits_t BIT_OTA_RUNNING = (1 << 5);
+
 ESP_EVENT_DECLARE_BASE(APP_EVENT);
 
 enum {
     APP_EVENT_BARCODE_SCANNED = 1,
+    APP_EVENT_STATION_IDLE,
+    APP_EVENT_STATION_ACTIVE,
 };
 
 struct ScanEvent {
     char barcode[32];
 };
 
+// APP_EVENT_BARCODE_SCANNED carries no data, esp_event would heap-copy it on every post.
+// Scans go through this ring instead, each consumer keeps its own cursor.
+constexpr uint32_t SCAN_RING_SLOTS = 4;
+
+void scan_ring_push(const ScanEvent& evt);
+
+// false once the cursor caught up, a consumer that fell more than SCAN_RING_SLOTS behind skips ahead
+bool scan_ring_pop(uint32_t& cursor, ScanEvent& out);
+
+// cursor value that only sees scans pushed from now on
+uint32_t scan_ring_head();
+
 enum class ControlType {
     WAKE,
     SLEEP,
@@ -30,6 +49,8 @@ enum class ControlType {
     MQTT_UNREACHABLE,
     MQTT_INIT_TIMEOUT,
     WIFI_CONNECTED,
+    SCHEDULE,
+    STATS,
 };
 
 struct ControlMessage {
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "sdkconfig.h"
+
+// station handlers that run in foreign tasks (event loop, MQTT) on the scan path
+enum HeapAuditHandler : uint8_t {
+    HEAP_AUDIT_SCAN_REQUEST,    // on_barcode_scanned, budgeted: the QoS 1 outbox entry per request
+    HEAP_AUDIT_PRODUCT_REPLY,   // handle_product_json, must not allocate
+    HEAP_AUDIT_HANDLER_COUNT,
+};
+
+struct HeapAuditHandlerStats {
+    uint32_t calls;
+    uint32_t last_allocs;
+    uint32_t max_allocs;
+    size_t max_bytes;           // largest total allocated in one call
+};
+
+struct HeapAuditStats {
+    uint32_t scans;
+    uint32_t scans_with_allocs;     // scans during which a watched task allocated
+    uint32_t last_scan_allocs;      // all allocations in the last scan window, any task
+    size_t free_bytes;
+    size_t largest_free_block;
+    size_t min_free_bytes;          // low-water mark since boot
+    size_t min_largest_free_block;  // worst fragmentation seen since boot
+    HeapAuditHandlerStats handlers[HEAP_AUDIT_HANDLER_COUNT];
+};
+
+#if CONFIG_HEAP_AUDIT
+
+void heap_audit_init();
+
+// registers the calling task, its allocations inside a scan window are a bug
+void heap_audit_watch_current_task();
+
+// window from a completed barcode frame to the frame that shows its answer
+void heap_audit_scan_begin();
+void heap_audit_scan_end();
+
+// counts what the calling task allocates until handler_end, only one call per handler at a time
+void heap_audit_handler_begin(HeapAuditHandler handler);
+void heap_audit_handler_end(HeapAuditHandler handler);
+
+HeapAuditStats heap_audit_stats();
+
+#else
+
+inline void heap_audit_init() {}
+inline void heap_audit_watch_current_task() {}
+inline void heap_audit_scan_begin() {}
+inline void heap_audit_scan_end() {}
+inline void heap_audit_handler_begin(HeapAuditHandler) {}
+inline void heap_audit_handler_end(HeapAuditHandler) {}
+inline HeapAuditStats heap_audit_stats() { return {}; }
+
+#endif
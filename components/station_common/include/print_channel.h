@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include "print_message.h"
+
+struct PrintChannelStats {
+    uint32_t screens_dropped;   // oldest screen pushed out of a full lane
+    uint32_t status_coalesced;  // status overwritten before the display read it
+};
+
+// Display input, split into lanes so status noise can never push out a product reply:
+//   status  latest-value mailbox per kind (Wi-Fi, MQTT), a new value replaces an unread one
+//   screen  short FIFO of product/error screens, a full lane drops its oldest entry
+// receive() hands out screens first, then changed status values.
+class PrintChannel {
+public:
+    // pool slots in the lane plus one being rendered and one per producer being filled never exceed the pool
+    static constexpr UBaseType_t SCREEN_LANE_LEN = PRODUCT_POOL_SLOTS - 1 - PRODUCT_POOL_PRODUCERS;
+
+    PrintChannel() = default;
+    PrintChannel(const PrintChannel&) = delete;
+    PrintChannel& operator=(const PrintChannel&) = delete;
+
+    void init();
+
+    void post_wifi(bool connected, uint8_t ip_last_octet);
+    void post_mqtt(bool connected);
+    void post_screen(const PrintMessage& msg);
+
+    bool receive(PrintMessage& msg, TickType_t timeout);
+
+    PrintChannelStats stats() const;
+
+private:
+    enum StatusKind : uint8_t { STATUS_WIFI, STATUS_MQTT, STATUS_COUNT };
+
+    void post_status(StatusKind kind, const PrintMessage& msg);
+    bool take_status(PrintMessage& msg);
+    static void release(const PrintMessage& msg);
+
+    QueueHandle_t screens_ = nullptr;
+    StaticQueue_t screens_struct_{};
+    uint8_t screens_storage_[SCREEN_LANE_LEN * sizeof(PrintMessage)]{};
+
+    SemaphoreHandle_t doorbell_ = nullptr;
+    StaticSemaphore_t doorbell_struct_{};
+
+    mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+    PrintMessage status_[STATUS_COUNT]{};
+    bool status_dirty_[STATUS_COUNT]{};
+    PrintChannelStats stats_{};
+};
@@ -1,15 +1,27 @@
 #pragma once
 
 #include <cstdint>
+#include "sdkconfig.h"
 #include "product_data.h"
 
-enum PrintMessageType {
+enum PrintMessageType : uint8_t {
     PRODUCT_DATA,
     WIFI_STATUS,
     MQTT_STATUS,
     ERROR_MSG,
 };
 
+// texts live in a const table on the display side, see print_error_text()
+enum PrintError : uint8_t {
+    PRINT_ERR_RETRY_SCAN,
+    PRINT_ERR_BARCODE_TOO_LONG,
+    PRINT_ERR_PRODUCT_MISSING,
+    PRINT_ERR_INVALID_DATA,
+    PRINT_ERR_NVS_WRITE,
+    PRINT_ERR_NVS_READ,
+    PRINT_ERR_COUNT,
+};
+
 struct WifiStatusPayload {
     bool connected;
     uint8_t ipLastOctet;
@@ -19,16 +31,32 @@ struct MqttStatusPayload {
     bool connected;
 };
 
-struct ErrorPayload {
-    char msg[128];
-};
-
+// fits in a pointer, products travel as an index into the product pool
 struct PrintMessage {
     PrintMessageType type;
     union {
-        ProductData product;
+        uint8_t product_slot;
         WifiStatusPayload wifi;
         MqttStatusPayload mqtt;
-        ErrorPayload error;
+        PrintError error;
     } data;
-};
\ No newline at end of file
+};
+
+static_assert(sizeof(PrintMessage) <= sizeof(void*), "PrintMessage must stay pointer-sized");
+
+const char* print_error_text(PrintError error);
+
+// tasks that fill slots: MQTT replies, plus cache hits served from the event loop
+#if CONFIG_PRODUCT_CACHE
+constexpr uint8_t PRODUCT_POOL_PRODUCERS = 2;
+#else
+constexpr uint8_t PRODUCT_POOL_PRODUCERS = 1;
+#endif
+
+// a full screen lane, the screen being rendered and one slot per producer being filled
+constexpr uint8_t PRODUCT_POOL_SLOTS = 3 + PRODUCT_POOL_PRODUCERS;
+
+// each producer fills a slot and queues its index, the display releases it after rendering
+ProductData* product_pool_acquire(uint8_t& slot);
+const ProductData& product_pool_get(uint8_t slot);
+void product_pool_release(uint8_t slot);
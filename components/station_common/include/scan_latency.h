@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+struct ScanLatencyStats {
+    uint32_t samples;
+    uint32_t p50_ms;
+    uint32_t p99_ms;
+    uint32_t max_ms;
+};
+
+// completed barcode frame -> first rendered screen after it
+void scan_latency_begin();
+void scan_latency_end();
+
+ScanLatencyStats scan_latency_stats();
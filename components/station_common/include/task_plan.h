@@ -0,0 +1,24 @@
+#pragma once
+
+#include "sdkconfig.h"
+#include <freertos/FreeRTOS.h>
+
+// network stack pins (Wi-Fi, lwIP, MQTT) are set in sdkconfig.defaults, these cover our own tasks
+#if CONFIG_STATION_TASK_PROFILE_SPLIT
+constexpr BaseType_t NETWORK_CORE = 0;  // PRO_CPU
+constexpr BaseType_t UI_CORE = 1;       // APP_CPU
+constexpr const char* TASK_PROFILE_NAME = "split";
+#else
+constexpr BaseType_t NETWORK_CORE = tskNO_AFFINITY;
+constexpr BaseType_t UI_CORE = tskNO_AFFINITY;
+constexpr const char* TASK_PROFILE_NAME = "unpinned";
+#endif
+
+constexpr UBaseType_t DISPLAY_TASK_PRIORITY = CONFIG_STATION_DISPLAY_TASK_PRIORITY;
+constexpr UBaseType_t BARCODE_TASK_PRIORITY = CONFIG_STATION_BARCODE_TASK_PRIORITY;
+constexpr UBaseType_t LVGL_TASK_PRIORITY = CONFIG_STATION_LVGL_TASK_PRIORITY;
+
+// bytes, ESP-IDF FreeRTOS counts stack depth in bytes
+constexpr uint32_t DISPLAY_TASK_STACK = CONFIG_STATION_DISPLAY_TASK_STACK;
+constexpr uint32_t BARCODE_TASK_STACK = CONFIG_STATION_BARCODE_TASK_STACK;
+constexpr uint32_t OTA_TASK_STACK = CONFIG_STATION_OTA_TASK_STACK;
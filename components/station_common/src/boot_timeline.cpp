@@ -0,0 +1,57 @@
+#include "boot_timeline.h"
+#include <atomic>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "boot_timeline";
+
+static std::atomic<int64_t> s_stage_us[BOOT_STAGE_COUNT] = {-1, -1, -1, -1, -1};
+static std::atomic<uint8_t> s_reached{0};
+
+static const char* stage_name(const BootStage stage)
+{
+    switch (stage) {
+        case BOOT_STAGE_IP: return "IP";
+        case BOOT_STAGE_TLS: return "TLS";
+        case BOOT_STAGE_SUBSCRIBED: return "subscribed";
+        case BOOT_STAGE_FIRST_FRAME: return "first frame";
+        case BOOT_STAGE_SCANNER_READY: return "scanner ready";
+        default: return "unknown";
+    }
+}
+
+void boot_timeline_mark(const BootStage stage)
+{
+    if (stage >= BOOT_STAGE_COUNT) {
+        return;
+    }
+
+    int64_t unset = -1;
+    if (!s_stage_us[stage].compare_exchange_strong(unset, esp_timer_get_time(), std::memory_order_acq_rel)) {
+        return;
+    }
+
+    if (s_reached.fetch_add(1, std::memory_order_acq_rel) + 1 == BOOT_STAGE_COUNT) {
+        boot_timeline_log();
+    }
+}
+
+int64_t boot_timeline_stage_us(const BootStage stage)
+{
+    return (stage < BOOT_STAGE_COUNT) ? s_stage_us[stage].load(std::memory_order_acquire) : -1;
+}
+
+void boot_timeline_log()
+{
+    // esp_timer starts with the app, ROM and bootloader time are not included
+    ESP_LOGI(TAG, "reset: 0 ms");
+    for (uint8_t i = 0; i < BOOT_STAGE_COUNT; ++i) {
+        const auto stage = static_cast<BootStage>(i);
+        const int64_t us = boot_timeline_stage_us(stage);
+        if (us < 0) {
+            ESP_LOGI(TAG, "%s: not reached", stage_name(stage));
+        } else {
+            ESP_LOGI(TAG, "%s: %lld ms", stage_name(stage), us / 1000);
+        }
+    }
+}
@@ -1,3 +1,41 @@
 #include "events.h"
 
 ESP_EVENT_DEFINE_BASE(APP_EVENT);
+
+static struct {
+    ScanEvent slots[SCAN_RING_SLOTS]{};
+    uint32_t head{0};
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+} s_scan_ring;
+
+void scan_ring_push(const ScanEvent& evt)
+{
+    portENTER_CRITICAL(&s_scan_ring.mux);
+    s_scan_ring.slots[s_scan_ring.head % SCAN_RING_SLOTS] = evt;
+    s_scan_ring.head++;
+    portEXIT_CRITICAL(&s_scan_ring.mux);
+}
+
+bool scan_ring_pop(uint32_t& cursor, ScanEvent& out)
+{
+    portENTER_CRITICAL(&s_scan_ring.mux);
+    const uint32_t head = s_scan_ring.head;
+    if (head - cursor > SCAN_RING_SLOTS) {
+        cursor = head - SCAN_RING_SLOTS;
+    }
+    const bool available = cursor != head;
+    if (available) {
+        out = s_scan_ring.slots[cursor % SCAN_RING_SLOTS];
+        cursor++;
+    }
+    portEXIT_CRITICAL(&s_scan_ring.mux);
+    return available;
+}
+
+uint32_t scan_ring_head()
+{
+    portENTER_CRITICAL(&s_scan_ring.mux);
+    const uint32_t head = s_scan_ring.head;
+    portEXIT_CRITICAL(&s_scan_ring.mux);
+    return head;
+}
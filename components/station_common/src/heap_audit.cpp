@@ -0,0 +1,250 @@
+#include "sdkconfig.h"
+#include "heap_audit.h"
+
+#if CONFIG_HEAP_AUDIT
+
+#include <atomic>
+#include <cstdlib>
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "events.h"
+
+static const char *TAG = "heap_audit";
+
+constexpr size_t MAX_WATCHED_TASKS = 4;
+
+static const char* const HANDLER_NAMES[HEAP_AUDIT_HANDLER_COUNT] = {
+    "scan request",
+    "product reply",
+};
+
+// allocations a handler may make per call, see the memory budget in main.cpp
+static constexpr uint32_t HANDLER_ALLOC_BUDGET[HEAP_AUDIT_HANDLER_COUNT] = {
+    // esp-mqtt copies each QoS 1 request into an outbox item (item + message), freed on PUBACK,
+    // one call drains at most the whole scan ring
+    2 * SCAN_RING_SLOTS,
+    0,
+};
+
+struct HandlerWindow {
+    std::atomic<TaskHandle_t> task{nullptr};
+    std::atomic<uint32_t> allocs{0};
+    std::atomic<uint32_t> bytes{0};
+};
+
+static struct {
+    TaskHandle_t watched[MAX_WATCHED_TASKS]{};
+    std::atomic<uint8_t> watched_count{0};
+
+    std::atomic<bool> window_open{false};
+    std::atomic<uint32_t> window_allocs{0};
+    std::atomic<uint32_t> window_watched_allocs{0};
+    TaskHandle_t offender{};
+    size_t offender_size{0};
+
+    HandlerWindow handlers[HEAP_AUDIT_HANDLER_COUNT];
+
+    esp_timer_handle_t report_timer{};
+    portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+    HeapAuditStats stats{};
+} s_ctx;
+
+static bool IRAM_ATTR is_watched(const TaskHandle_t task)
+{
+    const uint8_t count = s_ctx.watched_count.load(std::memory_order_acquire);
+    for (uint8_t i = 0; i < count; ++i) {
+        if (s_ctx.watched[i] == task) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// called by the heap for every allocation (CONFIG_HEAP_USE_HOOKS), must not allocate or log
+extern "C" void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t)
+{
+    if (ptr == nullptr || xPortInIsrContext()) {
+        return;
+    }
+
+    const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for (HandlerWindow& window : s_ctx.handlers) {
+        if (window.task.load(std::memory_order_relaxed) == task) {
+            window.allocs.fetch_add(1, std::memory_order_relaxed);
+            window.bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+    }
+
+    if (!s_ctx.window_open.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    s_ctx.window_allocs.fetch_add(1, std::memory_order_relaxed);
+
+    if (is_watched(task) && s_ctx.window_watched_allocs.fetch_add(1, std::memory_order_relaxed) == 0) {
+        s_ctx.offender = task;
+        s_ctx.offender_size = size;
+    }
+}
+
+extern "C" void IRAM_ATTR esp_heap_trace_free_hook(void *)
+{
+}
+
+static void sample_heap()
+{
+    const size_t free_bytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    const size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+    portENTER_CRITICAL(&s_ctx.stats_mux);
+    s_ctx.stats.free_bytes = free_bytes;
+    s_ctx.stats.largest_free_block = largest;
+    if (s_ctx.stats.min_free_bytes == 0 || free_bytes < s_ctx.stats.min_free_bytes) {
+        s_ctx.stats.min_free_bytes = free_bytes;
+    }
+    if (s_ctx.stats.min_largest_free_block == 0 || largest < s_ctx.stats.min_largest_free_block) {
+        s_ctx.stats.min_largest_free_block = largest;
+    }
+    portEXIT_CRITICAL(&s_ctx.stats_mux);
+}
+
+static void report_timer_cb(void*)
+{
+    sample_heap();
+    const HeapAuditStats stats = heap_audit_stats();
+
+    // share of free memory not usable for a single allocation
+    const unsigned fragmentation = stats.free_bytes > 0
+        ? static_cast<unsigned>(100 - (stats.largest_free_block * 100) / stats.free_bytes)
+        : 0;
+
+    ESP_LOGI(TAG, "uptime %llu h: free %u (min %u), largest block %u (min %u), fragmentation %u%%, "
+                  "%lu scans, %lu with allocations",
+             (unsigned long long)(esp_timer_get_time() / 3600000000LL),
+             (unsigned)stats.free_bytes, (unsigned)stats.min_free_bytes,
+             (unsigned)stats.largest_free_block, (unsigned)stats.min_largest_free_block,
+             fragmentation, (unsigned long)stats.scans, (unsigned long)stats.scans_with_allocs);
+    for (int i = 0; i < HEAP_AUDIT_HANDLER_COUNT; ++i) {
+        const HeapAuditHandlerStats& handler = stats.handlers[i];
+        ESP_LOGI(TAG, "handler '%s': %lu calls, up to %lu allocations / %u bytes per call", HANDLER_NAMES[i],
+                 (unsigned long)handler.calls, (unsigned long)handler.max_allocs, (unsigned)handler.max_bytes);
+    }
+}
+
+void heap_audit_init()
+{
+    esp_log_level_set(TAG, ESP_LOG_DEBUG);
+    sample_heap();
+
+    esp_timer_create_args_t timer_args{};
+    timer_args.callback = &report_timer_cb;
+    timer_args.name = "heap_audit";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_ctx.report_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(s_ctx.report_timer, CONFIG_HEAP_AUDIT_REPORT_S * 1000000ULL));
+}
+
+void heap_audit_watch_current_task()
+{
+    const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    if (is_watched(task)) {
+        return;
+    }
+
+    const uint8_t slot = s_ctx.watched_count.load(std::memory_order_acquire);
+    if (slot >= MAX_WATCHED_TASKS) {
+        ESP_LOGW(TAG, "Too many watched tasks, %s not audited", pcTaskGetName(task));
+        return;
+    }
+    s_ctx.watched[slot] = task;
+    s_ctx.watched_count.store(slot + 1, std::memory_order_release);
+}
+
+void heap_audit_scan_begin()
+{
+    s_ctx.window_allocs = 0;
+    s_ctx.window_watched_allocs = 0;
+    s_ctx.offender = nullptr;
+    s_ctx.window_open.store(true, std::memory_order_release);
+}
+
+void heap_audit_scan_end()
+{
+    if (!s_ctx.window_open.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    const uint32_t allocs = s_ctx.window_allocs.load();
+    const uint32_t watched_allocs = s_ctx.window_watched_allocs.load();
+
+    portENTER_CRITICAL(&s_ctx.stats_mux);
+    s_ctx.stats.scans++;
+    s_ctx.stats.last_scan_allocs = allocs;
+    if (watched_allocs > 0) {
+        s_ctx.stats.scans_with_allocs++;
+    }
+    portEXIT_CRITICAL(&s_ctx.stats_mux);
+
+    // esp-mqtt and esp_event copy every event they dispatch, those are counted but not ours to fix
+    ESP_LOGD(TAG, "Scan window: %lu allocations, %lu in station tasks", (unsigned long)allocs, (unsigned long)watched_allocs);
+
+    if (watched_allocs > 0) {
+        ESP_LOGE(TAG, "Task %s allocated %u bytes while serving a scan (%lu allocations)",
+                 pcTaskGetName(s_ctx.offender), (unsigned)s_ctx.offender_size, (unsigned long)watched_allocs);
+#if CONFIG_HEAP_AUDIT_ASSERT
+        abort();
+#endif
+    }
+}
+
+void heap_audit_handler_begin(const HeapAuditHandler handler)
+{
+    HandlerWindow& window = s_ctx.handlers[handler];
+    window.allocs.store(0, std::memory_order_relaxed);
+    window.bytes.store(0, std::memory_order_relaxed);
+    window.task.store(xTaskGetCurrentTaskHandle(), std::memory_order_release);
+}
+
+void heap_audit_handler_end(const HeapAuditHandler handler)
+{
+    HandlerWindow& window = s_ctx.handlers[handler];
+    window.task.store(nullptr, std::memory_order_release);
+    const uint32_t allocs = window.allocs.load(std::memory_order_relaxed);
+    const uint32_t bytes = window.bytes.load(std::memory_order_relaxed);
+
+    portENTER_CRITICAL(&s_ctx.stats_mux);
+    HeapAuditHandlerStats& stats = s_ctx.stats.handlers[handler];
+    stats.calls++;
+    stats.last_allocs = allocs;
+    if (allocs > stats.max_allocs) {
+        stats.max_allocs = allocs;
+    }
+    if (bytes > stats.max_bytes) {
+        stats.max_bytes = bytes;
+    }
+    portEXIT_CRITICAL(&s_ctx.stats_mux);
+
+    if (allocs > HANDLER_ALLOC_BUDGET[handler]) {
+        ESP_LOGE(TAG, "Handler '%s' allocated %lu bytes in %lu allocations", HANDLER_NAMES[handler],
+                 (unsigned long)bytes, (unsigned long)allocs);
+#if CONFIG_HEAP_AUDIT_ASSERT
+        abort();
+#endif
+    } else if (allocs > 0) {
+        ESP_LOGD(TAG, "Handler '%s': %lu allocations, %lu bytes (budgeted)", HANDLER_NAMES[handler],
+                 (unsigned long)allocs, (unsigned long)bytes);
+    }
+}
+
+HeapAuditStats heap_audit_stats()
+{
+    portENTER_CRITICAL(&s_ctx.stats_mux);
+    const HeapAuditStats stats = s_ctx.stats;
+    portEXIT_CRITICAL(&s_ctx.stats_mux);
+    return stats;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "print_channel.h"
+
+void PrintChannel::init()
+{
+    if (screens_ != nullptr) {
+        return;
+    }
+    screens_ = xQueueCreateStatic(SCREEN_LANE_LEN, sizeof(PrintMessage), screens_storage_, &screens_struct_);
+    doorbell_ = xSemaphoreCreateBinaryStatic(&doorbell_struct_);
+}
+
+void PrintChannel::release(const PrintMessage& msg)
+{
+    if (msg.type == PRODUCT_DATA) {
+        product_pool_release(msg.data.product_slot);
+    }
+}
+
+void PrintChannel::post_status(const StatusKind kind, const PrintMessage& msg)
+{
+    portENTER_CRITICAL(&mux_);
+    if (status_dirty_[kind]) {
+        stats_.status_coalesced++;
+    }
+    status_[kind] = msg;
+    status_dirty_[kind] = true;
+    portEXIT_CRITICAL(&mux_);
+
+    xSemaphoreGive(doorbell_);
+}
+
+void PrintChannel::post_wifi(const bool connected, const uint8_t ip_last_octet)
+{
+    PrintMessage msg{};
+    msg.type = WIFI_STATUS;
+    msg.data.wifi.connected = connected;
+    msg.data.wifi.ipLastOctet = ip_last_octet;
+    post_status(STATUS_WIFI, msg);
+}
+
+void PrintChannel::post_mqtt(const bool connected)
+{
+    PrintMessage msg{};
+    msg.type = MQTT_STATUS;
+    msg.data.mqtt.connected = connected;
+    post_status(STATUS_MQTT, msg);
+}
+
+void PrintChannel::post_screen(const PrintMessage& msg)
+{
+    // the newest answer is the one the customer is waiting for, make room by dropping the oldest
+    while (xQueueSend(screens_, &msg, 0) != pdTRUE) {
+        PrintMessage oldest{};
+        if (xQueueReceive(screens_, &oldest, 0) == pdTRUE) {
+            release(oldest);
+            portENTER_CRITICAL(&mux_);
+            stats_.screens_dropped++;
+            portEXIT_CRITICAL(&mux_);
+        }
+    }
+
+    xSemaphoreGive(doorbell_);
+}
+
+bool PrintChannel::take_status(PrintMessage& msg)
+{
+    bool taken = false;
+
+    portENTER_CRITICAL(&mux_);
+    for (uint8_t kind = 0; kind < STATUS_COUNT; ++kind) {
+        if (status_dirty_[kind]) {
+            msg = status_[kind];
+            status_dirty_[kind] = false;
+            taken = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&mux_);
+
+    return taken;
+}
+
+bool PrintChannel::receive(PrintMessage& msg, const TickType_t timeout)
+{
+    if (xQueueReceive(screens_, &msg, 0) == pdTRUE || take_status(msg)) {
+        return true;
+    }
+    if (timeout == 0 || xSemaphoreTake(doorbell_, timeout) != pdTRUE) {
+        return false;
+    }
+    return xQueueReceive(screens_, &msg, 0) == pdTRUE || take_status(msg);
+}
+
+PrintChannelStats PrintChannel::stats() const
+{
+    portENTER_CRITICAL(&mux_);
+    const PrintChannelStats stats = stats_;
+    portEXIT_CRITICAL(&mux_);
+    return stats;
+}
@@ -0,0 +1,60 @@
+#include "print_message.h"
+#include "freertos/FreeRTOS.h"
+
+static const char* const PRINT_ERROR_TEXTS[PRINT_ERR_COUNT] = {
+    "Zkuste prosim znovu...",                            // PRINT_ERR_RETRY_SCAN
+    "Barcode too long",                                  // PRINT_ERR_BARCODE_TOO_LONG
+    "Zavolejte prosim obsluhu ->\nprodukt chybi v db",   // PRINT_ERR_PRODUCT_MISSING
+    "Zavolejte prosim obsluhu ->\nnevalidni format dat", // PRINT_ERR_INVALID_DATA
+    "NVS error (set wake)",                              // PRINT_ERR_NVS_WRITE
+    "NVS error (read mode)",                             // PRINT_ERR_NVS_READ
+};
+
+static struct {
+    ProductData slots[PRODUCT_POOL_SLOTS]{};
+    uint8_t used{0};
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+} s_pool;
+
+static_assert(PRODUCT_POOL_SLOTS <= 8, "slot bitmap is a uint8_t");
+
+const char* print_error_text(const PrintError error)
+{
+    return error < PRINT_ERR_COUNT ? PRINT_ERROR_TEXTS[error] : "";
+}
+
+ProductData* product_pool_acquire(uint8_t& slot)
+{
+    ProductData* product = nullptr;
+
+    portENTER_CRITICAL(&s_pool.mux);
+    for (uint8_t i = 0; i < PRODUCT_POOL_SLOTS; ++i) {
+        if ((s_pool.used & (1U << i)) == 0) {
+            s_pool.used |= (1U << i);
+            slot = i;
+            product = &s_pool.slots[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_pool.mux);
+
+    if (product != nullptr) {
+        *product = ProductData{};
+    }
+    return product;
+}
+
+const ProductData& product_pool_get(const uint8_t slot)
+{
+    return s_pool.slots[slot % PRODUCT_POOL_SLOTS];
+}
+
+void product_pool_release(const uint8_t slot)
+{
+    if (slot >= PRODUCT_POOL_SLOTS) {
+        return;
+    }
+    portENTER_CRITICAL(&s_pool.mux);
+    s_pool.used &= ~(1U << slot);
+    portEXIT_CRITICAL(&s_pool.mux);
+}
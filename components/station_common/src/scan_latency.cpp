@@ -0,0 +1,91 @@
+#include "scan_latency.h"
+#include <atomic>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "task_plan.h"
+
+static const char *TAG = "scan_latency";
+
+// 5 ms buckets up to 1.28 s, the last bucket collects everything slower
+constexpr uint32_t BUCKET_MS = 5;
+constexpr size_t BUCKET_COUNT = 256;
+
+static struct {
+    std::atomic<int64_t> started_us{0};
+    uint16_t buckets[BUCKET_COUNT]{};
+    uint32_t samples{0};
+    uint32_t max_ms{0};
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+} s_ctx;
+
+static uint32_t percentile_ms(const uint32_t samples, const uint32_t permille)
+{
+    // rank of the sample at the percentile, bucket upper bound is reported
+    const uint32_t rank = (samples * permille + 999) / 1000;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += s_ctx.buckets[i];
+        if (seen >= rank) {
+            return (i + 1) * BUCKET_MS;
+        }
+    }
+    return BUCKET_COUNT * BUCKET_MS;
+}
+
+void scan_latency_begin()
+{
+    s_ctx.started_us.store(esp_timer_get_time(), std::memory_order_release);
+}
+
+void scan_latency_end()
+{
+    const int64_t started_us = s_ctx.started_us.exchange(0, std::memory_order_acq_rel);
+    if (started_us == 0) {
+        return;
+    }
+
+    const auto ms = static_cast<uint32_t>((esp_timer_get_time() - started_us) / 1000);
+    const size_t bucket = (ms / BUCKET_MS < BUCKET_COUNT) ? ms / BUCKET_MS : BUCKET_COUNT - 1;
+
+    portENTER_CRITICAL(&s_ctx.mux);
+    if (s_ctx.buckets[bucket] == UINT16_MAX) {
+        // halve everything instead of saturating, keeps the shape of the distribution
+        s_ctx.samples = 0;
+        for (uint16_t& count : s_ctx.buckets) {
+            count /= 2;
+            s_ctx.samples += count;
+        }
+    }
+    s_ctx.buckets[bucket]++;
+    s_ctx.samples++;
+    if (ms > s_ctx.max_ms) {
+        s_ctx.max_ms = ms;
+    }
+    const uint32_t samples = s_ctx.samples;
+    portEXIT_CRITICAL(&s_ctx.mux);
+
+    if (samples % CONFIG_STATION_LATENCY_REPORT_SCANS == 0) {
+        const ScanLatencyStats stats = scan_latency_stats();
+        ESP_LOGI(TAG, "Scan to render (%s profile, %lu scans): p50 %lu ms, p99 %lu ms, max %lu ms",
+                 TASK_PROFILE_NAME, (unsigned long)stats.samples, (unsigned long)stats.p50_ms,
+                 (unsigned long)stats.p99_ms, (unsigned long)stats.max_ms);
+    }
+}
+
+ScanLatencyStats scan_latency_stats()
+{
+    ScanLatencyStats stats{};
+
+    portENTER_CRITICAL(&s_ctx.mux);
+    stats.samples = s_ctx.samples;
+    stats.max_ms = s_ctx.max_ms;
+    if (stats.samples > 0) {
+        stats.p50_ms = percentile_ms(stats.samples, 500);
+        stats.p99_ms = percentile_ms(stats.samples, 990);
+    }
+    portEXIT_CRITICAL(&s_ctx.mux);
+
+    return stats;
+}
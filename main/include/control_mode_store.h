@@ -8,5 +8,10 @@ enum PersistedControlMode : uint8_t {
     PERSISTED_MODE_SLEEP = 1,
 };
 
+// updates the RTC copy only, unchanged modes are a no-op
 esp_err_t control_mode_store_set(PersistedControlMode mode);
+
+// writes a changed mode to NVS, call once per sleep/wake transition
+esp_err_t control_mode_store_commit();
+
 esp_err_t control_mode_store_get(PersistedControlMode* mode_out);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include "esp_err.h"
+
+// Weekly opening hours, retained on <MQTT_TOPIC_CONTROL>/schedule, kept in RTC memory and NVS.
+//
+// payload: "<mon>,<tue>,<wed>,<thu>,<fri>,<sat>,<sun>"
+// each day is "HHMM-HHMM" in local time (STATION_TZ) or "-" when closed
+esp_err_t opening_schedule_store(const char* spec, size_t len);
+
+// true once a schedule was received, from RTC memory or NVS
+bool opening_schedule_loaded();
+
+// seconds until the next opening at or after now, 0 while open, -1 without a schedule or open day
+int64_t opening_schedule_seconds_until_open(time_t now);
+
+// SNTP set the clock, the RTC keeps it across deep sleep until STATION_TIME_TRUST_H runs out
+void opening_schedule_note_time_sync();
+bool opening_schedule_time_trusted();
+
+// seconds until the clock needs SNTP again, 0 when it is not trusted
+int64_t opening_schedule_time_trust_left_s();
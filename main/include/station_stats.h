@@ -0,0 +1,11 @@
+#pragma once
+
+#include "esp_err.h"
+
+class DisplayDevice;
+class PrintChannel;
+
+// One compact JSON record on <MQTT_TOPIC_STATUS>/<client id>/stats, for right-sizing stacks
+// and buffers: per-task CPU share and stack high-water mark, heap per capability, LVGL pool
+// use and the station's own counters. Requested with the "stats" control command.
+esp_err_t station_stats_publish(const DisplayDevice& display, const PrintChannel& print);
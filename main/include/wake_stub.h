@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// Deep-sleep wake stub that runs from RTC fast memory before the bootloader loads the app.
+// While sleep time is left it re-arms the timer for another chunk and sleeps again,
+// the app only boots once the countdown is over or the wake was not the timer.
+void wake_stub_arm(uint64_t remaining_s, uint64_t chunk_s);
+void wake_stub_disarm();
+
+// timer wakes the stub put back to sleep during the last armed sleep
+uint32_t wake_stub_absorbed_wakes();
@@ -2,13 +2,47 @@
 
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_attr.h"
 
 static const char* TAG = "control_mode_store";
 static constexpr const char* NVS_NAMESPACE = "ctrl_mode";
 static constexpr const char* NVS_KEY_MODE = "mode";
+static constexpr uint32_t RTC_MODE_MAGIC = 0x4D4F4445; // "MODE"
+
+// authoritative copy, NVS only backs it across power loss
+struct RtcModeState {
+    uint32_t magic;
+    PersistedControlMode mode;
+    bool dirty;
+};
+
+RTC_DATA_ATTR static RtcModeState s_rtc_mode;
+
+static bool rtc_mode_valid()
+{
+    return s_rtc_mode.magic == RTC_MODE_MAGIC;
+}
 
 esp_err_t control_mode_store_set(PersistedControlMode mode)
 {
+    if (rtc_mode_valid() && s_rtc_mode.mode == mode) {
+        return ESP_OK;
+    }
+
+    s_rtc_mode.mode = mode;
+    s_rtc_mode.dirty = true;
+    s_rtc_mode.magic = RTC_MODE_MAGIC;
+    ESP_LOGD(TAG, "Mode changed to %s, NVS write deferred to next commit",
+             (mode == PERSISTED_MODE_SLEEP) ? "SLEEP" : "WAKE");
+    return ESP_OK;
+}
+
+esp_err_t control_mode_store_commit()
+{
+    if (!rtc_mode_valid() || !s_rtc_mode.dirty) {
+        return ESP_OK;
+    }
+
     nvs_handle_t handle = 0;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
     if (err != ESP_OK) {
@@ -16,7 +50,7 @@ esp_err_t control_mode_store_set(PersistedControlMode mode)
         return err;
     }
 
-    err = nvs_set_u8(handle, NVS_KEY_MODE, static_cast<uint8_t>(mode));
+    err = nvs_set_u8(handle, NVS_KEY_MODE, static_cast<uint8_t>(s_rtc_mode.mode));
     if (err == ESP_OK) {
         err = nvs_commit(handle);
     }
@@ -25,9 +59,11 @@ esp_err_t control_mode_store_set(PersistedControlMode mode)
 
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "nvs write/commit failed: %s", esp_err_to_name(err));
+        return err;
     }
 
-    return err;
+    s_rtc_mode.dirty = false;
+    return ESP_OK;
 }
 
 esp_err_t control_mode_store_get(PersistedControlMode* mode_out)
@@ -36,6 +72,11 @@ esp_err_t control_mode_store_get(PersistedControlMode* mode_out)
         return ESP_ERR_INVALID_ARG;
     }
 
+    if (rtc_mode_valid()) {
+        *mode_out = s_rtc_mode.mode;
+        return ESP_OK;
+    }
+
     nvs_handle_t handle = 0;
     esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
     if (err != ESP_OK) {
@@ -56,5 +97,9 @@ esp_err_t control_mode_store_get(PersistedControlMode* mode_out)
         *mode_out = PERSISTED_MODE_WAKE;
     }
 
+    s_rtc_mode.mode = *mode_out;
+    s_rtc_mode.dirty = false;
+    s_rtc_mode.magic = RTC_MODE_MAGIC;
+
     return ESP_OK;
 }
@@ -9,17 +9,26 @@
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
 #include "freertos/event_groups.h"
 #include "wifi_service.h"
 #include "mqtt_service.h"
 #include "display_task.h"
 #include "barcode_task.h"
 #include "ota_task.h"
+#include "ota_resume_store.h"
 #include "display_device.h"
 #include "barcode_device.h"
 #include "events.h"
-#include "print_message.h"
+#include "print_channel.h"
 #include "control_mode_store.h"
+#include "opening_schedule.h"
+#include "wake_stub.h"
+#include "station_stats.h"
+#include "power_manager.h"
+#include "boot_timeline.h"
+#include "heap_audit.h"
+#include "task_plan.h"
 
 static const char* TAG = "main";
 
@@ -33,6 +42,8 @@ static const char* control_type_to_string(const ControlType type)
         case ControlType::MQTT_UNREACHABLE: return "MQTT_UNREACHABLE";
         case ControlType::MQTT_INIT_TIMEOUT: return "MQTT_INIT_TIMEOUT";
         case ControlType::WIFI_CONNECTED: return "WIFI_CONNECTED";
+        case ControlType::SCHEDULE: return "SCHEDULE";
+        case ControlType::STATS: return "STATS";
         default: return "UNKNOWN";
     }
 }
@@ -61,45 +72,162 @@ static void init_system()
         ESP_ERROR_CHECK(nvs_flash_erase());
         ESP_ERROR_CHECK(nvs_flash_init());
     }
+    ESP_ERROR_CHECK(power_manager_init());
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
+
+    // opening hours are local time
+    setenv("TZ", CONFIG_STATION_TZ, 1);
+    tzset();
 }
 
-static void enter_deep_sleep(const uint64_t durationSec)
+[[noreturn]] static void enter_deep_sleep(const uint64_t durationSec)
 {
     ESP_LOGI(TAG, "Entering deep sleep...");
-    if (durationSec > 0) {
-        esp_sleep_enable_timer_wakeup(durationSec* 1000000ULL);
+    uint64_t timer_s = durationSec;
+    if (timer_s > CONFIG_SCHEDULE_MAX_SLEEP_S) {
+        timer_s = CONFIG_SCHEDULE_MAX_SLEEP_S;
+#if CONFIG_BOOT_WAKE_STUB
+        // the stub sleeps through the remaining chunks without booting the app
+        wake_stub_arm(durationSec - timer_s, CONFIG_SCHEDULE_MAX_SLEEP_S);
+    } else {
+        wake_stub_disarm();
+#endif
+    }
+    if (timer_s > 0) {
+        esp_sleep_enable_timer_wakeup(timer_s * 1000000ULL);
     }
     esp_deep_sleep_start();
 }
 
-static void delete_task_safe(TaskHandle_t& handle_ref)
+// Statically reserved memory budget (.bss, internal DRAM), so the steady state does not
+// depend on heap fragmentation after days of uptime:
+//
+//   display task stack + TCB      STATION_DISPLAY_TASK_STACK + ~350
+//   barcode task stack + TCB      STATION_BARCODE_TASK_STACK + ~350
+//   print channel                 2 screens + status mailboxes (~0.2 KB, products by pool index)
+//   product pool                  PRODUCT_POOL_SLOTS x sizeof(ProductData) (~0.6 KB, one more with PRODUCT_CACHE)
+//   product cache                 PRODUCT_CACHE_SLOTS x ~180 (1.4 KB at 8, product_cache.cpp)
+//   controlQueue                  8 x sizeof(ControlMessage) (~1.1 KB)
+//   event group                   ~32
+//   LVGL draw buffers             2 x 320 x DISPLAY_BUFFER_LINES x 2 (25.6 KB each at 40 lines, display_device.cpp)
+//   LVGL object pool              LV_MEM_SIZE, LVGL's builtin allocator never touches the system heap
+//   MQTT client buffers           2 x MQTT_BUFFER_SIZE, allocated once in mqtt_service_init
+//
+// Still on the heap: Wi-Fi, lwIP and mbedtls, the MQTT outbox and the OTA task with its
+// download buffers, which only exist while an update runs. Per scan, the only station
+// allocation is the QoS 1 outbox entry of the product request (topic + header, ~100 B),
+// freed on PUBACK; HEAP_AUDIT counts it per call and asserts the reply path stays at zero.
+constexpr size_t CONTROL_QUEUE_LEN = 8;
+
+// how long a transition may wait for task ACKs, and how often it is checked meanwhile
+constexpr TickType_t TRANSITION_TIMEOUT = pdMS_TO_TICKS(5000);
+constexpr TickType_t TRANSITION_POLL = pdMS_TO_TICKS(20);
+
+static StackType_t s_display_stack[DISPLAY_TASK_STACK];
+static StaticTask_t s_display_tcb;
+static StackType_t s_barcode_stack[BARCODE_TASK_STACK];
+static StaticTask_t s_barcode_tcb;
+
+static uint8_t s_control_queue_storage[CONTROL_QUEUE_LEN * sizeof(ControlMessage)];
+static StaticQueue_t s_control_queue_struct;
+static StaticEventGroup_t s_event_group_struct;
+
+// everything app_main owns that the control handlers need
+struct Station {
+    PrintChannel& print;
+    QueueHandle_t controlQueue;
+    EventGroupHandle_t eventGroup;
+    DisplayDevice& display;
+    BarcodeDevice& barcode;
+    DisplayTaskParams& display_params;
+    BarcodeTaskParams& barcode_params;
+    OtaTaskParams& ota_params;
+};
+
+// IDLE consumes commands, the other states wait for task ACK bits until their deadline
+// while the loop keeps draining the control queue
+enum class ControlState : uint8_t {
+    IDLE,
+    STOPPING,
+    CONFIGURING_SCANNER,
+};
+
+enum class ModeRequest : uint8_t {
+    NONE,
+    WAKE,
+    SLEEP,
+};
+
+static struct {
+    ControlState state{ControlState::IDLE};
+    TickType_t deadline{0};
+    EventBits_t awaiting{0};
+    ModeRequest pending_mode{ModeRequest::NONE};
+    bool scanner_conf_pending{false};
+    bool speculative{false};
+    bool ota_resume_checked{false};
+    bool sleep_waits_for_ota{false};
+    TaskHandle_t h_display{};
+    TaskHandle_t h_barcode{};
+} s_ctx;
+
+static const char* control_state_to_string(const ControlState state)
 {
-    if (handle_ref != nullptr) {
-        vTaskDelete(handle_ref);
-        handle_ref = nullptr;
+    switch (state) {
+        case ControlState::IDLE: return "IDLE";
+        case ControlState::STOPPING: return "STOPPING";
+        case ControlState::CONFIGURING_SCANNER: return "CONFIGURING_SCANNER";
+        default: return "UNKNOWN";
+    }
+}
+
+static EventBits_t running_task_bits()
+{
+    EventBits_t task_bits = 0;
+    if (s_ctx.h_display != nullptr) task_bits |= BIT_ACK_DISPLAY;
+    if (s_ctx.h_barcode != nullptr) task_bits |= BIT_ACK_BARCODE;
+    return task_bits;
+}
+
+static void start_station_tasks(Station& station)
+{
+    if (s_ctx.h_display == nullptr) {
+        s_ctx.h_display = xTaskCreateStaticPinnedToCore(display_task, "display", DISPLAY_TASK_STACK, &station.display_params,
+                                                        DISPLAY_TASK_PRIORITY, s_display_stack, &s_display_tcb, UI_CORE);
+    }
+    if (s_ctx.h_barcode == nullptr) {
+        s_ctx.h_barcode = xTaskCreateStaticPinnedToCore(barcode_task, "barcode", BARCODE_TASK_STACK, &station.barcode_params,
+                                                        BARCODE_TASK_PRIORITY, s_barcode_stack, &s_barcode_tcb, UI_CORE);
     }
 }
 
-static void send_nvs_error(QueueHandle_t printQueue, const char* action, esp_err_t err)
+static void enter_transition(const ControlState state, const EventBits_t awaiting)
+{
+    ESP_LOGD(TAG, "Transition %s -> %s", control_state_to_string(s_ctx.state), control_state_to_string(state));
+    s_ctx.state = state;
+    s_ctx.awaiting = awaiting;
+    s_ctx.sleep_waits_for_ota = false;
+    s_ctx.deadline = xTaskGetTickCount() + TRANSITION_TIMEOUT;
+}
+
+static bool transition_expired()
+{
+    return static_cast<int32_t>(xTaskGetTickCount() - s_ctx.deadline) >= 0;
+}
+
+static void send_nvs_error(PrintChannel& print, const PrintError error)
 {
     PrintMessage err_msg{};
     err_msg.type = ERROR_MSG;
-    snprintf(err_msg.data.error.msg,
-             sizeof(err_msg.data.error.msg),
-             "NVS error (%s): %s",
-             action,
-             esp_err_to_name(err));
-    xQueueOverwrite(printQueue, &err_msg);
+    err_msg.data.error = error;
+    print.post_screen(err_msg);
 }
 
 static void enforce_devices_sleep(DisplayDevice& display_device, BarcodeDevice& barcode_device)
 {
-    const esp_err_t display_err = display_device.sleep();
-    if (display_err != ESP_OK) {
-        ESP_LOGW(TAG, "Display sleep failed: %s", esp_err_to_name(display_err));
-    }
+    // backlight fades out in hardware while the scanner is put to sleep
+    display_device.fade_out();
 
     const esp_err_t barcode_err = barcode_device.sleep();
     if (barcode_err != ESP_OK) {
@@ -110,6 +238,11 @@ static void enforce_devices_sleep(DisplayDevice& display_device, BarcodeDevice&
     if (barcode_prepare_err != ESP_OK) {
         ESP_LOGW(TAG, "Barcode deep sleep preparation failed: %s", esp_err_to_name(barcode_prepare_err));
     }
+
+    const esp_err_t display_err = display_device.sleep();
+    if (display_err != ESP_OK) {
+        ESP_LOGW(TAG, "Display sleep failed: %s", esp_err_to_name(display_err));
+    }
 }
 
 void time_sync_cb(struct timeval *tv)
@@ -121,195 +254,415 @@ void time_sync_cb(struct timeval *tv)
     char strftime_buf[64];
     strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
     ESP_LOGI(TAG, "Time sync event hit, current time: %s", strftime_buf);
+    opening_schedule_note_time_sync();
 }
 
-extern "C" [[noreturn]] void app_main(void)
+static void start_sntp(void* = nullptr)
 {
-    init_system();
-    esp_log_level_set(TAG, ESP_LOG_DEBUG);
-
-    static QueueHandle_t printQueue = xQueueCreate(8, sizeof(PrintMessage));
-    static QueueHandle_t controlQueue = xQueueCreate(3, sizeof(ControlMessage));
-    static EventGroupHandle_t eventGroup = xEventGroupCreate();
-
-    wifi_service_init(printQueue, controlQueue);
-
+    if (esp_sntp_enabled()) {
+        return;
+    }
     esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
     esp_sntp_setservername(0, "pool.ntp.org");
     sntp_set_time_sync_notification_cb(time_sync_cb);
     esp_sntp_init();
+}
 
-    static DisplayDevice display_device;
-    static BarcodeDevice barcode_device;
+// a clock kept by the RTC since the last sync saves the SNTP round trip at boot,
+// the query is only deferred until the trust window runs out
+static void schedule_sntp()
+{
+    const int64_t trust_left_s = opening_schedule_time_trust_left_s();
+    if (trust_left_s <= 0) {
+        start_sntp();
+        return;
+    }
 
-    static DisplayTaskParams display_params {
-        .printQueue = printQueue,
-        .eventGroup = eventGroup,
-        .device = display_device,
-    };
+    ESP_LOGI(TAG, "RTC time trusted for another %lld s, skipping SNTP at boot", trust_left_s);
+    static esp_timer_handle_t sntp_timer = nullptr;
+    esp_timer_create_args_t timer_args{};
+    timer_args.callback = &start_sntp;
+    timer_args.name = "sntp_defer";
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sntp_timer));
+    ESP_ERROR_CHECK(esp_timer_start_once(sntp_timer, trust_left_s * 1000000ULL));
+}
 
-    static BarcodeTaskParams barcode_params {
-        .printQueue = printQueue,
-        .eventGroup = eventGroup,
-        .device = barcode_device,
-    };
+// the RC slow clock drifts by a share of the sleep, so the lead grows with it
+static int64_t wake_lead_s(const int64_t until_open_s)
+{
+    const int64_t scaled_s = until_open_s * CONFIG_SCHEDULE_WAKE_LEAD_PERMILLE / 1000;
+    return (scaled_s > CONFIG_SCHEDULE_WAKE_LEAD_S) ? scaled_s : CONFIG_SCHEDULE_WAKE_LEAD_S;
+}
 
-    static OtaTaskParams ota_params { .eventGroup = eventGroup, .url = "" };
+// until the next opening when the clock can be trusted, otherwise the fixed poll interval
+static uint64_t sleep_duration_s()
+{
+    if (!opening_schedule_time_trusted()) {
+        return CONFIG_DEEP_SLEEP_DURATION;
+    }
 
-    static TaskHandle_t h_display = nullptr;
-    static TaskHandle_t h_barcode = nullptr;
+    const int64_t until_open = opening_schedule_seconds_until_open(time(nullptr));
+    const int64_t lead_s = wake_lead_s(until_open);
+    if (until_open <= lead_s) {
+        // no schedule, or open now while the broker keeps the station asleep
+        return CONFIG_DEEP_SLEEP_DURATION;
+    }
 
-    ControlMessage msg{};
+    const int64_t sleep_s = until_open - lead_s;
+    ESP_LOGI(TAG, "Closed for %lld s, sleeping %lld s", until_open, sleep_s);
+    return static_cast<uint64_t>(sleep_s);
+}
 
-    for (;;) {
-        if (xQueueReceive(controlQueue, &msg, portMAX_DELAY) != pdTRUE) {
-            continue;
+static PersistedControlMode persisted_mode_or_wake(PrintChannel& print)
+{
+    PersistedControlMode persisted_mode = PERSISTED_MODE_WAKE;
+    const esp_err_t err = control_mode_store_get(&persisted_mode);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(TAG, "No persisted mode found, defaulting to WAKE");
+    } else if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to read persisted mode (%s), defaulting to WAKE", esp_err_to_name(err));
+        send_nvs_error(print, PRINT_ERR_NVS_READ);
+    }
+    return persisted_mode;
+}
+
+// the last mode command wins, a queued WAKE followed by SLEEP never starts the devices
+static void request_mode(const ModeRequest mode)
+{
+    if (s_ctx.pending_mode != ModeRequest::NONE && s_ctx.pending_mode != mode) {
+        ESP_LOGI(TAG, "%s supersedes pending %s", mode == ModeRequest::SLEEP ? "SLEEP" : "WAKE",
+                 mode == ModeRequest::SLEEP ? "WAKE" : "SLEEP");
+    }
+    s_ctx.pending_mode = mode;
+}
+
+static void apply_wake(Station& station)
+{
+    control_mode_store_set(PERSISTED_MODE_WAKE);
+    const esp_err_t persist_err = control_mode_store_commit();
+    if (persist_err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to persist WAKE mode: %s", esp_err_to_name(persist_err));
+        send_nvs_error(station.print, PRINT_ERR_NVS_WRITE);
+    }
+    if (s_ctx.speculative) {
+        ESP_LOGD(TAG, "WAKE confirms speculative start");
+        s_ctx.speculative = false;
+    }
+    // tasks that have not seen STOP yet keep running, those that stopped (or are about to)
+    // find RESUME set and continue, it stays set until the next SLEEP
+    xEventGroupClearBits(station.eventGroup, BIT_REQ_STOP | BIT_ACK_DISPLAY | BIT_ACK_BARCODE);
+    xEventGroupSetBits(station.eventGroup, BIT_REQ_RESUME);
+    start_station_tasks(station);
+}
+
+static void begin_sleep(Station& station)
+{
+    control_mode_store_set(PERSISTED_MODE_SLEEP);
+    if (s_ctx.speculative) {
+        ESP_LOGI(TAG, "SLEEP disagrees with persisted WAKE, rolling back speculative start");
+        s_ctx.speculative = false;
+    }
+
+    const EventBits_t task_bits = running_task_bits();
+    ESP_LOGD(TAG, "Stopping tasks: %s", active_tasks_to_string(task_bits));
+    xEventGroupClearBits(station.eventGroup, task_bits | BIT_REQ_RESUME);
+    xEventGroupSetBits(station.eventGroup, BIT_REQ_STOP);
+    enter_transition(ControlState::STOPPING, task_bits);
+}
+
+[[noreturn]] static void finish_sleep(Station& station)
+{
+    boot_timeline_log();
+    power_manager_log_stats();
+    enforce_devices_sleep(station.display, station.barcode);
+
+    // single NVS commit for the whole transition, the panel is already off so only log
+    const esp_err_t persist_err = control_mode_store_commit();
+    if (persist_err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to persist SLEEP mode: %s", esp_err_to_name(persist_err));
+    }
+
+    enter_deep_sleep(sleep_duration_s());
+}
+
+static void begin_scanner_conf(Station& station)
+{
+    s_ctx.scanner_conf_pending = false;
+    if (s_ctx.h_barcode == nullptr) {
+        ESP_LOGE(TAG, "No Barcode Task Running!");
+        return;
+    }
+    ESP_LOGI(TAG, "Initiating Scanner Configuration...");
+    xEventGroupClearBits(station.eventGroup, BIT_ACK_BARCODE);
+    xEventGroupSetBits(station.eventGroup, BIT_REQ_BARCODE_SCANNER_CONF);
+    enter_transition(ControlState::CONFIGURING_SCANNER, BIT_ACK_BARCODE);
+}
+
+static void start_firmware_update(Station& station, const char* url)
+{
+    if ((xEventGroupGetBits(station.eventGroup) & BIT_OTA_RUNNING) != 0) {
+        ESP_LOGW(TAG, "FIRMWARE: update already in progress, ignoring");
+        return;
+    }
+
+    // downloads in the background, the station keeps serving scans until the reboot
+    strlcpy(station.ota_params.url, url, sizeof(station.ota_params.url));
+    xEventGroupSetBits(station.eventGroup, BIT_OTA_RUNNING);
+
+    if (xTaskCreatePinnedToCore(ota_task, "ota", OTA_TASK_STACK, &station.ota_params, CONFIG_OTA_TASK_PRIORITY, nullptr, NETWORK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "FIRMWARE: failed to create OTA task");
+        xEventGroupClearBits(station.eventGroup, BIT_OTA_RUNNING);
+    }
+}
+
+static void on_wifi_connected(Station& station)
+{
+    mqtt_service_init(station.print, station.controlQueue);
+
+    // a download cut short by a reboot picks up where its last checkpoint left off
+    OtaResumeState ota_resume{};
+    if (!s_ctx.ota_resume_checked && ota_resume_store_load(&ota_resume) == ESP_OK) {
+        ESP_LOGI(TAG, "Resuming interrupted firmware download");
+        start_firmware_update(station, ota_resume.url);
+    }
+    s_ctx.ota_resume_checked = true;
+}
+
+// records what a message asks for, only commands that never wait run right away
+static void handle_control(Station& station, const ControlMessage& msg)
+{
+    ESP_LOGD(TAG, "Received Control Type: %s (state %s)", control_type_to_string(msg.type),
+             control_state_to_string(s_ctx.state));
+
+    switch (msg.type) {
+        case ControlType::WAKE:
+            request_mode(ModeRequest::WAKE);
+            break;
+
+        case ControlType::SLEEP:
+            request_mode(ModeRequest::SLEEP);
+            break;
+
+        case ControlType::MQTT_UNREACHABLE:
+        case ControlType::MQTT_INIT_TIMEOUT: {
+            // an explicit command already queued beats the persisted fallback
+            if (s_ctx.pending_mode != ModeRequest::NONE) {
+                break;
+            }
+            const PersistedControlMode persisted_mode = persisted_mode_or_wake(station.print);
+            ESP_LOGD(TAG, "%s fallback: %s", msg.type == ControlType::MQTT_UNREACHABLE ? "Unreachable" : "Init-timeout",
+                     persisted_mode == PERSISTED_MODE_SLEEP ? "SLEEP" : "WAKE");
+            request_mode(persisted_mode == PERSISTED_MODE_SLEEP ? ModeRequest::SLEEP : ModeRequest::WAKE);
+            break;
         }
 
-        ESP_LOGD(TAG, "Received Control Type: %s", control_type_to_string(msg.type));
+        case ControlType::FIRMWARE:
+            start_firmware_update(station, msg.payload);
+            break;
 
-        EventBits_t task_bits = 0;
-        if (h_display != nullptr) task_bits |= BIT_ACK_DISPLAY;
-        if (h_barcode != nullptr) task_bits |= BIT_ACK_BARCODE;
+        case ControlType::SCANNER_CONF:
+            s_ctx.scanner_conf_pending = true;
+            break;
 
-        ESP_LOGD(TAG, "Active Tasks: %s", active_tasks_to_string(task_bits));
+        case ControlType::WIFI_CONNECTED:
+            on_wifi_connected(station);
+            break;
 
-        switch (msg.type) {
-                case ControlType::WAKE: {
-                    const esp_err_t persist_err = control_mode_store_set(PERSISTED_MODE_WAKE);
-                    if (persist_err != ESP_OK) {
-                        ESP_LOGW(TAG, "Failed to persist WAKE mode: %s", esp_err_to_name(persist_err));
-                        send_nvs_error(printQueue, "set wake", persist_err);
-                    }
-                    xEventGroupClearBits(eventGroup, BIT_REQ_STOP | task_bits);
-                    if (h_display == nullptr) {
-                        xTaskCreate(display_task, "display", 4096, &display_params, 5, &h_display);
-                    }
-                    if (h_barcode == nullptr) {
-                        xTaskCreate(barcode_task, "barcode", 4096, &barcode_params, 5, &h_barcode);
-                    }
-                    break;
-                }
+        case ControlType::SCHEDULE: {
+            const esp_err_t err = opening_schedule_store(msg.payload, strlen(msg.payload));
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "SCHEDULE rejected: %s", esp_err_to_name(err));
+            }
+            break;
+        }
+
+        case ControlType::STATS: {
+            const esp_err_t err = station_stats_publish(station.display, station.print);
+            if (err != ESP_OK) {
+                ESP_LOGW(TAG, "STATS not published: %s", esp_err_to_name(err));
+            }
+            break;
+        }
+    }
+}
 
-                case ControlType::SLEEP: {
-                    const esp_err_t persist_err = control_mode_store_set(PERSISTED_MODE_SLEEP);
+static void poll_transition(Station& station)
+{
+    if (s_ctx.state == ControlState::IDLE) {
+        return;
+    }
+
+    const EventBits_t bits = xEventGroupGetBits(station.eventGroup);
+    const EventBits_t acked = bits & s_ctx.awaiting;
+    const bool done = acked == s_ctx.awaiting;
+    if (!done && !transition_expired()) {
+        return;
+    }
+
+    switch (s_ctx.state) {
+        case ControlState::STOPPING:
+            if (s_ctx.pending_mode == ModeRequest::WAKE) {
+                // a WAKE from this same pass cancels the sleep in apply_pending, never sleep over it
+                return;
+            }
+            if ((bits & BIT_OTA_RUNNING) != 0) {
+                // deep sleep in the middle of esp_ota_write or a sector erase would cut the flash write,
+                // the OTA task either restarts into the new image or clears the bit on failure
+                if (!s_ctx.sleep_waits_for_ota) {
+                    ESP_LOGI(TAG, "SLEEP: waiting for the firmware update to finish");
+                    s_ctx.sleep_waits_for_ota = true;
+                    // the restart after a successful update has to come back in SLEEP
+                    const esp_err_t persist_err = control_mode_store_commit();
                     if (persist_err != ESP_OK) {
                         ESP_LOGW(TAG, "Failed to persist SLEEP mode: %s", esp_err_to_name(persist_err));
-                        send_nvs_error(printQueue, "set sleep", persist_err);
-                    }
-                    xEventGroupClearBits(eventGroup, task_bits);
-                    xEventGroupSetBits(eventGroup, BIT_REQ_STOP);
-                    if (task_bits != 0) {
-                        const EventBits_t acked = xEventGroupWaitBits(eventGroup, task_bits, pdFALSE, pdTRUE, pdMS_TO_TICKS(5000));
-                        if ((acked & task_bits) != task_bits) {
-                            ESP_LOGE(TAG, "SLEEP: task ACK timeout (got 0x%lx, expected 0x%lx), forcing sleep",
-                                     (unsigned long)acked, (unsigned long)task_bits);
-                        }
                     }
+                }
+                return;
+            }
+            if (!done) {
+                ESP_LOGE(TAG, "SLEEP: task ACK timeout (got 0x%lx, expected 0x%lx), forcing sleep",
+                         (unsigned long)acked, (unsigned long)s_ctx.awaiting);
+            }
+            finish_sleep(station);
 
-                    enforce_devices_sleep(display_device, barcode_device);
+        case ControlState::CONFIGURING_SCANNER:
+            if (!done) {
+                ESP_LOGE(TAG, "SCANNER_CONF: barcode task ACK timeout");
+            }
+            ESP_LOGI(TAG, "Scanner Configuration & Save Completed.");
+            break;
 
-                    enter_deep_sleep(CONFIG_DEEP_SLEEP_DURATION);
-                    break;
-                }
+        case ControlState::IDLE:
+            break;
+    }
+    s_ctx.state = ControlState::IDLE;
+}
 
-                case ControlType::MQTT_UNREACHABLE: {
-                    PersistedControlMode persisted_mode = PERSISTED_MODE_WAKE;
-                    const esp_err_t err = control_mode_store_get(&persisted_mode);
-                    if (err == ESP_ERR_NVS_NOT_FOUND) {
-                        ESP_LOGW(TAG, "No persisted mode found, defaulting to WAKE");
-                    } else if (err != ESP_OK) {
-                        ESP_LOGW(TAG, "Failed to read persisted mode (%s), defaulting to WAKE", esp_err_to_name(err));
-                        send_nvs_error(printQueue, "read mode", err);
-                    }
+static void apply_pending(Station& station)
+{
+    if (s_ctx.state == ControlState::STOPPING && s_ctx.pending_mode == ModeRequest::WAKE) {
+        // tasks that already acknowledged wait on RESUME, WAKE releases them instead of sleeping
+        ESP_LOGI(TAG, "WAKE cancels SLEEP in progress");
+        s_ctx.pending_mode = ModeRequest::NONE;
+        s_ctx.state = ControlState::IDLE;
+        apply_wake(station);
+        return;
+    }
 
-                    ControlMessage fallback_msg{};
-                    fallback_msg.type = (persisted_mode == PERSISTED_MODE_SLEEP)
-                        ? ControlType::SLEEP
-                        : ControlType::WAKE;
-                    fallback_msg.payload[0] = '\0';
+    if (s_ctx.state != ControlState::IDLE) {
+        return;
+    }
 
-                    ESP_LOGD(TAG, "Unreachable fallback: %s",
-                             (fallback_msg.type == ControlType::SLEEP) ? "SLEEP" : "WAKE");
+    switch (s_ctx.pending_mode) {
+        case ModeRequest::WAKE:
+            s_ctx.pending_mode = ModeRequest::NONE;
+            apply_wake(station);
+            break;
+        case ModeRequest::SLEEP:
+            s_ctx.pending_mode = ModeRequest::NONE;
+            s_ctx.scanner_conf_pending = false;
+            begin_sleep(station);
+            return;
+        case ModeRequest::NONE:
+            break;
+    }
 
-                    if (xQueueSend(controlQueue, &fallback_msg, 0) != pdTRUE) {
-                        ESP_LOGW(TAG, "Failed to enqueue unreachable fallback control message");
-                    }
-                    break;
-                }
+    if (s_ctx.scanner_conf_pending) {
+        begin_scanner_conf(station);
+    }
+}
 
-                case ControlType::MQTT_INIT_TIMEOUT: {
-                    PersistedControlMode persisted_mode = PERSISTED_MODE_WAKE;
-                    const esp_err_t err = control_mode_store_get(&persisted_mode);
-                    if (err == ESP_ERR_NVS_NOT_FOUND) {
-                        ESP_LOGW(TAG, "No persisted mode found, defaulting to WAKE");
-                    } else if (err != ESP_OK) {
-                        ESP_LOGW(TAG, "Failed to read persisted mode (%s), defaulting to WAKE", esp_err_to_name(err));
-                        send_nvs_error(printQueue, "read mode", err);
-                    }
+extern "C" [[noreturn]] void app_main(void)
+{
+    init_system();
+    esp_log_level_set(TAG, ESP_LOG_DEBUG);
+    ESP_LOGI(TAG, "Task profile: %s", TASK_PROFILE_NAME);
 
-                    ControlMessage fallback_msg{};
-                    fallback_msg.type = (persisted_mode == PERSISTED_MODE_SLEEP)
-                        ? ControlType::SLEEP
-                        : ControlType::WAKE;
-                    fallback_msg.payload[0] = '\0';
+#if CONFIG_BOOT_WAKE_STUB
+    if (wake_stub_absorbed_wakes() > 0) {
+        ESP_LOGI(TAG, "Wake stub slept through %lu timer wakes", (unsigned long)wake_stub_absorbed_wakes());
+    }
+#endif
+
+    // a wake that only came from the sleep cap goes back to sleep before any radio or device work,
+    // normally the wake stub already did this without booting
+    PersistedControlMode wake_mode = PERSISTED_MODE_WAKE;
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER &&
+        control_mode_store_get(&wake_mode) == ESP_OK && wake_mode == PERSISTED_MODE_SLEEP &&
+        opening_schedule_time_trusted()) {
+        const int64_t until_open = opening_schedule_seconds_until_open(time(nullptr));
+        if (until_open > wake_lead_s(until_open)) {
+            enter_deep_sleep(sleep_duration_s());
+        }
+    }
 
-                    ESP_LOGD(TAG, "Init-timeout fallback: %s",
-                             (fallback_msg.type == ControlType::SLEEP) ? "SLEEP" : "WAKE");
+    heap_audit_init();
+    heap_audit_watch_current_task();
 
-                    if (xQueueSend(controlQueue, &fallback_msg, 0) != pdTRUE) {
-                        ESP_LOGW(TAG, "Failed to enqueue init-timeout fallback control message");
-                    }
-                    break;
-                }
+    static PrintChannel printChannel;
+    printChannel.init();
+    static QueueHandle_t controlQueue = xQueueCreateStatic(CONTROL_QUEUE_LEN, sizeof(ControlMessage),
+                                                           s_control_queue_storage, &s_control_queue_struct);
+    static EventGroupHandle_t eventGroup = xEventGroupCreateStatic(&s_event_group_struct);
 
-                case ControlType::FIRMWARE: {
-                    xEventGroupClearBits(eventGroup, task_bits);
-                    xEventGroupSetBits(eventGroup, BIT_REQ_STOP);
-                    if (task_bits != 0) {
-                        const EventBits_t acked = xEventGroupWaitBits(eventGroup, task_bits, pdFALSE, pdTRUE, pdMS_TO_TICKS(5000));
-                        if ((acked & task_bits) != task_bits) {
-                            ESP_LOGE(TAG, "FIRMWARE: task ACK timeout (got 0x%lx, expected 0x%lx), proceeding with OTA",
-                                     (unsigned long)acked, (unsigned long)task_bits);
-                        }
-                    }
+    static DisplayDevice display_device;
+    static BarcodeDevice barcode_device;
+
+    static DisplayTaskParams display_params {
+        .print = printChannel,
+        .eventGroup = eventGroup,
+        .device = display_device,
+    };
 
-                    // free ram so that another tls handshake can happen safely, smol
-                    delete_task_safe(h_display);
-                    delete_task_safe(h_barcode);
+    static BarcodeTaskParams barcode_params {
+        .print = printChannel,
+        .eventGroup = eventGroup,
+        .device = barcode_device,
+    };
 
-                    display_device.deinit();
-                    barcode_device.deinit();
+    static OtaTaskParams ota_params { .eventGroup = eventGroup, .url = "" };
 
-                    mqtt_service_stop();
-                    vTaskDelay(pdMS_TO_TICKS(500));
+    static Station station {
+        .print = printChannel,
+        .controlQueue = controlQueue,
+        .eventGroup = eventGroup,
+        .display = display_device,
+        .barcode = barcode_device,
+        .display_params = display_params,
+        .barcode_params = barcode_params,
+        .ota_params = ota_params,
+    };
 
-                    strlcpy(ota_params.url, msg.payload, sizeof(ota_params.url));
+    // bring the devices up from the last known mode while the network comes up,
+    // the retained control command confirms it or rolls it back through SLEEP
+#if CONFIG_BOOT_SPECULATIVE_START
+    PersistedControlMode boot_mode = PERSISTED_MODE_WAKE;
+    if (control_mode_store_get(&boot_mode) == ESP_OK && boot_mode == PERSISTED_MODE_WAKE) {
+        ESP_LOGI(TAG, "Speculatively starting devices from persisted WAKE");
+        start_station_tasks(station);
+        s_ctx.speculative = true;
+    }
+#endif
 
-                    xTaskCreate(ota_task, "ota", 8192, &ota_params, 3, nullptr);
-                    break;
-                }
+    wifi_service_init(printChannel, controlQueue);
 
-                case ControlType::SCANNER_CONF: {
-                    if (h_barcode == nullptr) {
-                        ESP_LOGE(TAG, "No Barcode Task Running!");
-                        break;
-                    }
-                    ESP_LOGI(TAG, "Initiating Scanner Configuration...");
-                    xEventGroupClearBits(eventGroup, BIT_ACK_BARCODE);
-                    xEventGroupSetBits(eventGroup, BIT_REQ_BARCODE_SCANNER_CONF);
-                    const EventBits_t acked = xEventGroupWaitBits(eventGroup, BIT_ACK_BARCODE, pdFALSE, pdTRUE, pdMS_TO_TICKS(5000));
-                    if ((acked & BIT_ACK_BARCODE) != BIT_ACK_BARCODE) {
-                        ESP_LOGE(TAG, "SCANNER_CONF: barcode task ACK timeout");
-                    }
-                    ESP_LOGI(TAG, "Scanner Configuration & Save Completed.");
-                    break;
-                }
+    schedule_sntp();
 
-                case ControlType::WIFI_CONNECTED: {
-                    mqtt_service_init(printQueue, controlQueue);
-                    break;
-                }
+    ControlMessage msg{};
+
+    for (;;) {
+        // block only while nothing is in flight, a transition is polled until its deadline
+        const TickType_t wait = (s_ctx.state == ControlState::IDLE) ? portMAX_DELAY : TRANSITION_POLL;
+
+        if (xQueueReceive(controlQueue, &msg, wait) == pdTRUE) {
+            handle_control(station, msg);
+            // take the whole burst before acting, so contradictory commands collapse
+            while (xQueueReceive(controlQueue, &msg, 0) == pdTRUE) {
+                handle_control(station, msg);
             }
+        }
+
+        poll_transition(station);
+        apply_pending(station);
     }
 }
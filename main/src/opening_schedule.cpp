@@ -0,0 +1,204 @@
+#include "opening_schedule.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sys/time.h>
+#include "sdkconfig.h"
+#include "nvs.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+
+static const char* TAG = "opening_schedule";
+static constexpr const char* NVS_NAMESPACE = "schedule";
+static constexpr const char* NVS_KEY_WEEK = "week";
+static constexpr uint32_t RTC_SCHEDULE_MAGIC = 0x53434844; // "SCHD"
+static constexpr size_t DAYS_PER_WEEK = 7;
+
+// minutes since local midnight, open == close means closed all day, index 0 is Monday
+struct WeekSchedule {
+    uint16_t open_min[DAYS_PER_WEEK];
+    uint16_t close_min[DAYS_PER_WEEK];
+};
+
+struct RtcScheduleState {
+    uint32_t magic;
+    WeekSchedule week;
+    time_t synced_at;   // last SNTP sync, 0 if the clock was never set
+};
+
+RTC_DATA_ATTR static RtcScheduleState s_rtc_schedule;
+
+static bool parse_hhmm(const char* s, uint16_t& minutes)
+{
+    int hh = 0;
+    int mm = 0;
+    if (sscanf(s, "%2d%2d", &hh, &mm) != 2 || hh > 24 || mm > 59 || (hh == 24 && mm != 0)) {
+        return false;
+    }
+    minutes = static_cast<uint16_t>(hh * 60 + mm);
+    return true;
+}
+
+static bool parse_week(const char* spec, WeekSchedule& week)
+{
+    const char* p = spec;
+    for (size_t day = 0; day < DAYS_PER_WEEK; ++day) {
+        const char* end = strchr(p, ',');
+        const size_t len = (end != nullptr) ? static_cast<size_t>(end - p) : strlen(p);
+
+        if (len == 1 && p[0] == '-') {
+            week.open_min[day] = 0;
+            week.close_min[day] = 0;
+        } else if (len != 9 || p[4] != '-' ||
+                   !parse_hhmm(p, week.open_min[day]) || !parse_hhmm(p + 5, week.close_min[day]) ||
+                   week.close_min[day] <= week.open_min[day]) {
+            ESP_LOGE(TAG, "Day %u: expected HHMM-HHMM or -, got '%.*s'", (unsigned)day, (int)len, p);
+            return false;
+        }
+
+        if (end == nullptr) {
+            return day == DAYS_PER_WEEK - 1;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+static bool load_from_nvs()
+{
+    nvs_handle_t handle = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return false;
+    }
+
+    WeekSchedule week{};
+    size_t size = sizeof(week);
+    const esp_err_t err = nvs_get_blob(handle, NVS_KEY_WEEK, &week, &size);
+    nvs_close(handle);
+
+    if (err != ESP_OK || size != sizeof(week)) {
+        return false;
+    }
+
+    s_rtc_schedule.week = week;
+    s_rtc_schedule.magic = RTC_SCHEDULE_MAGIC;
+    return true;
+}
+
+esp_err_t opening_schedule_store(const char* spec, const size_t len)
+{
+    char buf[128];
+    if (len == 0 || len >= sizeof(buf)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+
+    WeekSchedule week{};
+    if (!parse_week(buf, week)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (opening_schedule_loaded() && memcmp(&week, &s_rtc_schedule.week, sizeof(week)) == 0) {
+        // retained message seen again after a reconnect, nothing to write
+        return ESP_OK;
+    }
+
+    nvs_handle_t handle = 0;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs_open failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_set_blob(handle, NVS_KEY_WEEK, &week, sizeof(week));
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "nvs write/commit failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    s_rtc_schedule.week = week;
+    s_rtc_schedule.magic = RTC_SCHEDULE_MAGIC;
+    ESP_LOGI(TAG, "Opening hours updated: %s", buf);
+    return ESP_OK;
+}
+
+bool opening_schedule_loaded()
+{
+    return s_rtc_schedule.magic == RTC_SCHEDULE_MAGIC || load_from_nvs();
+}
+
+int64_t opening_schedule_seconds_until_open(const time_t now)
+{
+    if (!opening_schedule_loaded()) {
+        return -1;
+    }
+
+    tm today{};
+    localtime_r(&now, &today);
+    const size_t weekday = (today.tm_wday + 6) % DAYS_PER_WEEK; // tm_wday 0 is Sunday
+
+    // one extra day covers the rest of today's weekday next week
+    for (size_t offset = 0; offset <= DAYS_PER_WEEK; ++offset) {
+        const size_t day = (weekday + offset) % DAYS_PER_WEEK;
+        const WeekSchedule& week = s_rtc_schedule.week;
+        if (week.open_min[day] == week.close_min[day]) {
+            continue;
+        }
+
+        // mktime normalizes the day overflow and applies DST for that date
+        tm at = today;
+        at.tm_mday += static_cast<int>(offset);
+        at.tm_hour = 0;
+        at.tm_sec = 0;
+        at.tm_isdst = -1;
+        at.tm_min = week.open_min[day];
+        const time_t opens = mktime(&at);
+
+        at = today;
+        at.tm_mday += static_cast<int>(offset);
+        at.tm_hour = 0;
+        at.tm_sec = 0;
+        at.tm_isdst = -1;
+        at.tm_min = week.close_min[day];
+        const time_t closes = mktime(&at);
+
+        if (now < opens) {
+            return static_cast<int64_t>(opens - now);
+        }
+        if (now < closes) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void opening_schedule_note_time_sync()
+{
+    timeval tv{};
+    gettimeofday(&tv, nullptr);
+    s_rtc_schedule.synced_at = tv.tv_sec;
+}
+
+int64_t opening_schedule_time_trust_left_s()
+{
+    if (s_rtc_schedule.synced_at == 0) {
+        return 0;
+    }
+
+    timeval tv{};
+    gettimeofday(&tv, nullptr);
+    const int64_t since_sync = static_cast<int64_t>(tv.tv_sec) - s_rtc_schedule.synced_at;
+    const int64_t trust_s = CONFIG_STATION_TIME_TRUST_H * 3600LL;
+    return (since_sync >= 0 && since_sync < trust_s) ? trust_s - since_sync : 0;
+}
+
+bool opening_schedule_time_trusted()
+{
+    return opening_schedule_time_trust_left_s() > 0;
+}
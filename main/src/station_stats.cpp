@@ -0,0 +1,153 @@
+#include "station_stats.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "display_device.h"
+#include "display_task.h"
+#include "print_channel.h"
+#include "mqtt_service.h"
+#include "wifi_service.h"
+#include "tls_session_transport.h"
+#include "heap_audit.h"
+#include "scan_latency.h"
+#include "wake_stub.h"
+
+static const char* TAG = "station_stats";
+
+constexpr size_t MAX_REPORTED_TASKS = 32;
+// the report is enqueued in one piece, so it has to fit the MQTT out buffer (plus the terminator here)
+constexpr size_t REPORT_BUFFER_SIZE = mqtt_service_status_payload_max(sizeof("stats") - 1) + 1;
+
+// static so building a report neither allocates nor needs a big stack in the control loop
+static TaskStatus_t s_tasks[MAX_REPORTED_TASKS];
+static char s_report[REPORT_BUFFER_SIZE];
+
+struct ReportWriter {
+    char* buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+
+    __attribute__((format(printf, 2, 3))) void append(const char* fmt, ...)
+    {
+        if (overflow) {
+            return;
+        }
+        va_list args;
+        va_start(args, fmt);
+        const int n = vsnprintf(buf + len, size - len, fmt, args);
+        va_end(args);
+        if (n < 0 || static_cast<size_t>(n) >= size - len) {
+            overflow = true;
+            return;
+        }
+        len += n;
+    }
+};
+
+static void append_tasks(ReportWriter& w)
+{
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total_runtime = 0;
+    const UBaseType_t count = uxTaskGetSystemState(s_tasks, MAX_REPORTED_TASKS, &total_runtime);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %u tasks, task list omitted", (unsigned)MAX_REPORTED_TASKS);
+    }
+
+    // [name, core (-1 unpinned), priority, stack high-water mark in bytes, % of one core since boot]
+    w.append("\"tasks\":[");
+    for (UBaseType_t i = 0; i < count; ++i) {
+        const TaskStatus_t& task = s_tasks[i];
+        const BaseType_t core = xTaskGetCoreID(task.xHandle);
+        const unsigned cpu_pct = (total_runtime > 0)
+            ? static_cast<unsigned>((static_cast<uint64_t>(task.ulRunTimeCounter) * 100) / total_runtime)
+            : 0;
+        w.append("%s[\"%s\",%d,%u,%lu,%u]", (i > 0) ? "," : "", task.pcTaskName,
+                 (core == tskNO_AFFINITY) ? -1 : static_cast<int>(core),
+                 static_cast<unsigned>(task.uxCurrentPriority),
+                 static_cast<unsigned long>(task.usStackHighWaterMark), cpu_pct);
+    }
+    w.append("],");
+#else
+    w.append("\"tasks\":null,");
+#endif
+}
+
+static void append_heap(ReportWriter& w, const char* name, const uint32_t caps)
+{
+    // [free, minimum free since boot, largest free block]
+    w.append("\"%s\":[%u,%u,%u]", name,
+             static_cast<unsigned>(heap_caps_get_free_size(caps)),
+             static_cast<unsigned>(heap_caps_get_minimum_free_size(caps)),
+             static_cast<unsigned>(heap_caps_get_largest_free_block(caps)));
+}
+
+esp_err_t station_stats_publish(const DisplayDevice& display, const PrintChannel& print)
+{
+    ReportWriter w{ s_report, sizeof(s_report), 0, false };
+
+    w.append("{\"up\":%lld,", esp_timer_get_time() / 1000000LL);
+    append_tasks(w);
+
+    w.append("\"heap\":{");
+    append_heap(w, "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    w.append(",");
+    append_heap(w, "dma", MALLOC_CAP_DMA);
+    w.append(",");
+    append_heap(w, "iram", MALLOC_CAP_32BIT | MALLOC_CAP_EXEC);
+#if CONFIG_SPIRAM
+    w.append(",");
+    append_heap(w, "spiram", MALLOC_CAP_SPIRAM);
+#endif
+    w.append("},");
+
+    // [pool size, free, max used, fragmentation %]
+    DisplayMemStats lvgl{};
+    if (display.memory_stats(lvgl, 100)) {
+        w.append("\"lvgl\":[%lu,%lu,%lu,%u],", (unsigned long)lvgl.total_bytes, (unsigned long)lvgl.free_bytes,
+                 (unsigned long)lvgl.max_used_bytes, static_cast<unsigned>(lvgl.frag_pct));
+    } else {
+        w.append("\"lvgl\":null,");
+    }
+
+    // [frames, max frame us, messages folded away]
+    const DisplayStats frames = display.stats();
+    w.append("\"frames\":[%lu,%lu,%lu],", (unsigned long)frames.frames, (unsigned long)frames.max_frame_us,
+             (unsigned long)display_task_skipped_frames());
+
+    // [screens dropped, status messages coalesced]
+    const PrintChannelStats lanes = print.stats();
+    w.append("\"lanes\":[%lu,%lu],", (unsigned long)lanes.screens_dropped, (unsigned long)lanes.status_coalesced);
+
+    // [scans, p50 ms, p99 ms, max ms]
+    const ScanLatencyStats scan = scan_latency_stats();
+    w.append("\"scan\":[%lu,%lu,%lu,%lu],", (unsigned long)scan.samples, (unsigned long)scan.p50_ms,
+             (unsigned long)scan.p99_ms, (unsigned long)scan.max_ms);
+
+#if CONFIG_HEAP_AUDIT
+    // [scans, scans with allocations, minimum free, minimum largest block]
+    const HeapAuditStats audit = heap_audit_stats();
+    w.append("\"audit\":[%lu,%lu,%u,%u],", (unsigned long)audit.scans, (unsigned long)audit.scans_with_allocs,
+             static_cast<unsigned>(audit.min_free_bytes), static_cast<unsigned>(audit.min_largest_free_block));
+#endif
+
+    // [time to IP ms, last TLS handshake ms, ticket offered]
+    w.append("\"net\":[%lld,%lld,%d],", wifi_service_time_to_ip_us() / 1000, tls_session_last_handshake_us() / 1000,
+             tls_session_last_offered_ticket() ? 1 : 0);
+
+    w.append("\"stub\":%lu}", (unsigned long)wake_stub_absorbed_wakes());
+
+    if (w.overflow) {
+        ESP_LOGE(TAG, "Report exceeds %u bytes, raise MQTT_BUFFER_SIZE", (unsigned)(REPORT_BUFFER_SIZE - 1));
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGD(TAG, "%s", s_report);
+    return mqtt_service_publish_status("stats", s_report, w.len);
+}
@@ -0,0 +1,57 @@
+#include "wake_stub.h"
+
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_wake_stub.h"
+#include "soc/rtc.h"
+
+static constexpr uint32_t WAKE_STUB_MAGIC = 0x5354554B; // "STUK"
+
+// read by the stub, so it lives in RTC memory like the stub itself
+struct RtcWakeStubState {
+    uint32_t magic;
+    uint64_t remaining_s;
+    uint64_t chunk_s;
+    uint32_t absorbed_wakes;
+};
+
+RTC_DATA_ATTR static RtcWakeStubState s_stub;
+
+static void RTC_IRAM_ATTR station_wake_stub()
+{
+    // only plain ROM/RTC code is safe here: no flash, no heap, no FreeRTOS
+    if (s_stub.magic != WAKE_STUB_MAGIC || s_stub.remaining_s == 0 ||
+        (esp_wake_stub_get_wakeup_cause() & RTC_TIMER_TRIG_EN) == 0) {
+        esp_default_wake_deep_sleep();
+        return;
+    }
+
+    const uint64_t chunk_s = (s_stub.remaining_s < s_stub.chunk_s) ? s_stub.remaining_s : s_stub.chunk_s;
+    s_stub.remaining_s -= chunk_s;
+    s_stub.absorbed_wakes++;
+
+    esp_wake_stub_set_wakeup_time(chunk_s * 1000000ULL);
+    esp_wake_stub_sleep(&station_wake_stub);
+}
+
+void wake_stub_arm(const uint64_t remaining_s, const uint64_t chunk_s)
+{
+    s_stub.remaining_s = remaining_s;
+    s_stub.chunk_s = chunk_s;
+    s_stub.absorbed_wakes = 0;
+    s_stub.magic = WAKE_STUB_MAGIC;
+    esp_set_deep_sleep_wake_stub(&station_wake_stub);
+}
+
+void wake_stub_disarm()
+{
+    s_stub.magic = 0;
+    s_stub.remaining_s = 0;
+    // a sleep without the stub absorbs nothing, the next boot must not report the previous count
+    s_stub.absorbed_wakes = 0;
+}
+
+uint32_t wake_stub_absorbed_wakes()
+{
+    return s_stub.absorbed_wakes;
+}
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Generate LVGL fonts that only contain the glyphs the station UI renders.
+
+Each font size gets the characters of the UI string literals it is used for,
+plus the product-name character set for sizes that show product data or error
+texts. Requires lv_font_conv LV_FONT_CONV_VERSION, either installed
+(npm i -g lv_font_conv@<version>) or fetched through npx at that exact version.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+# size -> whether product names / units / error texts are rendered with it
+SIZES = {
+    10: False,  # status labels
+    18: True,   # unit price and stock
+    22: False,  # idle screen
+    24: True,   # product name
+    28: True,   # error screen
+    38: False,  # price
+}
+
+ALWAYS = " 0123456789.,:-"
+
+# pinned so the generated fonts are reproducible
+LV_FONT_CONV_VERSION = "1.5.2"
+
+STRING_LITERAL = re.compile(r'"((?:[^"\\]|\\.)*)"')
+FORMAT_SPEC = re.compile(r"%[-+ #0]*\d*(?:\.\d+)?(?:hh|h|ll|l|z)?[diouxXfFeEgGcsp%]")
+
+
+def ui_characters(sources):
+    chars = set(ALWAYS)
+    for path in sources:
+        with open(path, encoding="utf-8") as f:
+            for line in f:
+                if "ESP_LOG" in line or "#include" in line:
+                    continue
+                for literal in STRING_LITERAL.findall(line):
+                    literal = FORMAT_SPEC.sub("", literal.replace("\\n", ""))
+                    chars.update(c for c in literal if c.isprintable())
+    return chars
+
+
+def glyph_characters(path):
+    chars = set(" ")
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("#"):
+                continue
+            chars.update(c for c in line if c.isprintable())
+    return chars
+
+
+def font_converter():
+    if shutil.which("lv_font_conv"):
+        version = subprocess.run(["lv_font_conv", "--version"], capture_output=True, text=True).stdout.strip()
+        if version == LV_FONT_CONV_VERSION:
+            return ["lv_font_conv"]
+        print(f"gen_subset_fonts: installed lv_font_conv is {version or 'unknown'}, "
+              f"want {LV_FONT_CONV_VERSION}", file=sys.stderr)
+    if shutil.which("npx"):
+        return ["npx", "--yes", f"lv_font_conv@{LV_FONT_CONV_VERSION}"]
+    sys.exit(f"gen_subset_fonts: lv_font_conv {LV_FONT_CONV_VERSION} not found, install it with "
+             f"'npm i -g lv_font_conv@{LV_FONT_CONV_VERSION}' or disable CONFIG_DISPLAY_SUBSET_FONTS")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--font", required=True, help="TTF to subset (LVGL's Montserrat-Medium.ttf)")
+    parser.add_argument("--out-dir", required=True)
+    parser.add_argument("--glyphs", required=True, help="product-name character set file")
+    parser.add_argument("--names", help="optional product name export, one name per line")
+    parser.add_argument("--ui-sources", nargs="+", required=True)
+    parser.add_argument("--bpp", type=int, default=4)
+    args = parser.parse_args()
+
+    ui = ui_characters(args.ui_sources)
+    names = glyph_characters(args.glyphs)
+    if args.names:
+        names |= glyph_characters(args.names)
+
+    os.makedirs(args.out_dir, exist_ok=True)
+    converter = font_converter()
+
+    for size, with_names in SIZES.items():
+        symbols = "".join(sorted(ui | names if with_names else ui))
+        name = f"station_font_{size}"
+        cmd = converter + [
+            "--font", args.font,
+            "--symbols", symbols,
+            "--size", str(size),
+            "--bpp", str(args.bpp),
+            "--format", "lvgl",
+            "--lv-include", "lvgl.h",
+            "--lv-font-name", name,
+            "--no-compress",
+            "-o", os.path.join(args.out_dir, f"{name}.c"),
+        ]
+        subprocess.run(cmd, check=True)
+        print(f"{name}: {len(symbols)} glyphs")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Generate an "OPD1" delta OTA patch between two station app images.
+
+The patch reconstructs the target image from the base image the device is
+running, see components/network/include/delta_patch.h for the format. Serve
+it instead of the full image when the OTA request's X-Base-Elf-Sha256 header
+matches the base build (printed by this tool); the device tells the two apart
+by the magic and checks the target SHA-256 before switching partitions.
+
+Matching is greedy: exact runs of the base become COPY ops; the bytes between
+them become ADD ops (sparse byte diffs against the base at the same
+alignment), so relinked code with shifted addresses only ships the bytes that
+changed, or INSERT ops where the base has nothing similar.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"OPD1"
+OP_END, OP_COPY, OP_ADD, OP_INSERT = 0, 1, 2, 3
+
+# esp_image_header_t (24) + first segment header (8), then esp_app_desc_t
+APP_DESC_OFFSET = 32
+APP_DESC_MAGIC = 0xABCD5432
+APP_ELF_SHA256_OFFSET = APP_DESC_OFFSET + 144
+
+BLOCK = 32          # exact match granularity
+INDEX_STEP = 4      # base positions indexed
+ADD_MIN_SAME = 0.5  # fraction of unchanged bytes for a gap to be an ADD
+MAX_RUN = 0xFFFF
+
+
+def app_elf_sha256(image, name):
+    (magic,) = struct.unpack_from("<I", image, APP_DESC_OFFSET)
+    if image[0] != 0xE9 or magic != APP_DESC_MAGIC:
+        sys.exit(f"{name} is not an ESP app image")
+    return image[APP_ELF_SHA256_OFFSET:APP_ELF_SHA256_OFFSET + 32]
+
+
+def index_base(base):
+    index = {}
+    for pos in range(0, len(base) - BLOCK + 1, INDEX_STEP):
+        index.setdefault(base[pos:pos + BLOCK], pos)
+    return index
+
+
+def find_match(base, target, pos, index):
+    """Longest exact base run starting at target[pos], probing the next few alignments."""
+    for shift in range(INDEX_STEP):
+        found = index.get(target[pos + shift:pos + shift + BLOCK])
+        if found is None:
+            continue
+        start = found - shift
+        if start < 0 or base[start:found] != target[pos:pos + shift]:
+            continue
+        length = shift + BLOCK
+        while pos + length < len(target) and start + length < len(base) and base[start + length] == target[pos + length]:
+            length += 1
+        return start, length
+    return None
+
+
+def encode_add(base, target, base_off, tgt_off, length):
+    out = bytearray(struct.pack("<BII", OP_ADD, base_off, length))
+    i = 0
+    while i < length:
+        skip = 0
+        while i + skip < length and skip < MAX_RUN and base[base_off + i + skip] == target[tgt_off + i + skip]:
+            skip += 1
+        i += skip
+        lit = bytearray()
+        # short equal runs inside a literal are cheaper than a new run header
+        while i < length and len(lit) < MAX_RUN:
+            same = 0
+            while i + same < length and same < 4 and base[base_off + i + same] == target[tgt_off + i + same]:
+                same += 1
+            if same == 4:
+                break
+            lit.append((target[tgt_off + i] - base[base_off + i]) & 0xFF)
+            i += 1
+        out += struct.pack("<HH", skip, len(lit)) + lit
+    return out
+
+
+def encode_gap(base, target, tgt_off, length, base_off):
+    if length == 0:
+        return b""
+    if 0 <= base_off and base_off + length <= len(base):
+        same = sum(1 for k in range(length) if base[base_off + k] == target[tgt_off + k])
+        if same >= length * ADD_MIN_SAME:
+            return encode_add(base, target, base_off, tgt_off, length)
+    return struct.pack("<BI", OP_INSERT, length) + target[tgt_off:tgt_off + length]
+
+
+def make_patch(base, target):
+    index = index_base(base)
+    ops = bytearray()
+    stats = {"copy": 0, "gap": 0}
+
+    pos = gap_start = 0
+    delta = 0  # base position minus target position after the last COPY
+    while pos + BLOCK <= len(target):
+        match = find_match(base, target, pos, index)
+        if match is None:
+            pos += 1
+            continue
+        start, length = match
+        ops += encode_gap(base, target, gap_start, pos - gap_start, gap_start + delta)
+        stats["gap"] += pos - gap_start
+        ops += struct.pack("<BII", OP_COPY, start, length)
+        stats["copy"] += length
+        delta = start - pos
+        pos = gap_start = pos + length
+
+    ops += encode_gap(base, target, gap_start, len(target) - gap_start, gap_start + delta)
+    stats["gap"] += len(target) - gap_start
+    ops.append(OP_END)
+
+    header = MAGIC + app_elf_sha256(base, "base") + hashlib.sha256(target).digest() + struct.pack("<I", len(target))
+    return header + ops, stats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("base", help="app image the devices are running (build/<project>.bin)")
+    parser.add_argument("target", help="new app image")
+    parser.add_argument("-o", "--output", required=True, help="patch file to write")
+    args = parser.parse_args()
+
+    with open(args.base, "rb") as f:
+        base = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+    app_elf_sha256(target, "target")
+
+    patch, stats = make_patch(base, target)
+    with open(args.output, "wb") as f:
+        f.write(patch)
+
+    print(f"base elf sha256: {app_elf_sha256(base, 'base').hex()}")
+    print(f"target {len(target)} bytes, patch {len(patch)} bytes ({100 * len(patch) / len(target):.1f}%), "
+          f"{stats['copy']} bytes copied, {stats['gap']} bytes diffed or inserted")
+
+
+if __name__ == "__main__":
+    main()
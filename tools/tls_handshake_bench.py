@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Benchmark mutual-TLS 1.3 handshakes against a local mosquitto broker.
+
+Generates a throwaway CA, broker and client chain for each key type (RSA and
+ECDSA), starts mosquitto with require_certificate, then times full handshakes
+and ticket resumptions. Resumption sends an MQTT CONNECT first, so the broker's
+NewSessionTicket is read the same way the station reads it before CONNACK.
+Requires openssl and mosquitto on PATH.
+"""
+
+import argparse
+import os
+import shutil
+import socket
+import ssl
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+KEY_TYPES = {
+    "rsa2048": ["-newkey", "rsa:2048"],
+    "rsa4096": ["-newkey", "rsa:4096"],
+    "ecdsa-p256": ["-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1"],
+}
+
+# MQTT 3.1.1 CONNECT, clean session, client id "bench"
+MQTT_CONNECT = bytes([0x10, 0x11, 0x00, 0x04]) + b"MQTT" + bytes([0x04, 0x02, 0x00, 0x3C, 0x00, 0x05]) + b"bench"
+
+
+def openssl(*args, cwd):
+    subprocess.run(["openssl", *args], cwd=cwd, check=True, capture_output=True)
+
+
+def make_chain(workdir, key_args):
+    openssl("req", "-x509", *key_args, "-nodes", "-days", "1", "-subj", "/CN=bench-ca",
+            "-keyout", "ca.key", "-out", "ca.crt", cwd=workdir)
+    for name in ("server", "client"):
+        openssl("req", *key_args, "-nodes", "-subj", "/CN=localhost",
+                "-keyout", f"{name}.key", "-out", f"{name}.csr", cwd=workdir)
+        openssl("x509", "-req", "-in", f"{name}.csr", "-CA", "ca.crt", "-CAkey", "ca.key",
+                "-CAcreateserial", "-days", "1", "-out", f"{name}.crt", cwd=workdir)
+
+
+def start_broker(workdir, port):
+    conf = os.path.join(workdir, "mosquitto.conf")
+    with open(conf, "w", encoding="utf-8") as f:
+        f.write(f"listener {port} 127.0.0.1\n"
+                "cafile ca.crt\ncertfile server.crt\nkeyfile server.key\n"
+                "require_certificate true\ntls_version tlsv1.3\nallow_anonymous true\n")
+    broker = subprocess.Popen(["mosquitto", "-c", conf], cwd=workdir,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    deadline = time.monotonic() + 5
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.2).close()
+            return broker
+        except OSError:
+            time.sleep(0.05)
+    broker.kill()
+    sys.exit("mosquitto did not start")
+
+
+def client_context(workdir):
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    ctx.minimum_version = ssl.TLSVersion.TLSv1_3
+    ctx.load_verify_locations(os.path.join(workdir, "ca.crt"))
+    ctx.load_cert_chain(os.path.join(workdir, "client.crt"), os.path.join(workdir, "client.key"))
+    return ctx
+
+
+def handshake(ctx, port, session=None):
+    sock = socket.create_connection(("127.0.0.1", port))
+    start = time.perf_counter()
+    tls = ctx.wrap_socket(sock, server_hostname="localhost", session=session)
+    elapsed = time.perf_counter() - start
+    tls.sendall(MQTT_CONNECT)
+    tls.recv(4)  # CONNACK, the ticket is processed on the way
+    resumed = tls.session_reused
+    next_session = tls.session
+    tls.close()
+    return elapsed, resumed, next_session
+
+
+def bench(key_type, rounds, port):
+    with tempfile.TemporaryDirectory() as workdir:
+        make_chain(workdir, KEY_TYPES[key_type])
+        broker = start_broker(workdir, port)
+        try:
+            ctx = client_context(workdir)
+            full = [handshake(ctx, port)[0] for _ in range(rounds)]
+
+            _, _, session = handshake(ctx, port)
+            resumed = []
+            misses = 0
+            for _ in range(rounds):
+                elapsed, reused, session = handshake(ctx, port, session)
+                resumed.append(elapsed)
+                misses += not reused
+        finally:
+            broker.terminate()
+            broker.wait()
+
+    ms = lambda samples: statistics.median(samples) * 1000
+    print(f"{key_type:<12} full {ms(full):7.2f} ms   resumed {ms(resumed):7.2f} ms"
+          f"   ({misses} of {rounds} not resumed)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--rounds", type=int, default=50)
+    parser.add_argument("--port", type=int, default=18883)
+    parser.add_argument("--keys", nargs="+", choices=KEY_TYPES, default=list(KEY_TYPES))
+    args = parser.parse_args()
+
+    for tool in ("openssl", "mosquitto"):
+        if shutil.which(tool) is None:
+            sys.exit(f"{tool} not found on PATH")
+
+    print(f"median of {args.rounds} handshakes, mutual TLS 1.3 against mosquitto on 127.0.0.1")
+    for key_type in args.keys:
+        bench(key_type, args.rounds, args.port)
+
+
+if __name__ == "__main__":
+    main()